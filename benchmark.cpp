@@ -0,0 +1,584 @@
+// Benchmark suite for the library catalog.
+// Build: g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+// Usage: ./benchmark [--min-size N] [--max-size N] [--filter NAME] [--seed S]
+//
+// Catalog sizes run in powers of ten from 1e3 to 1e7 (or the given bounds).
+// Every result is printed as one JSON object per line:
+//   {"schema":1,"benchmark":"...","size":N,"iterations":K,"seconds":S,"ns_per_op":X,"ops_per_s":Y}
+// plus benchmark-specific fields (bytes, mb_per_s, threads, ...).
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#define LIBRARY_NO_MAIN
+#include "library.cpp"
+
+using Clock = chrono::steady_clock;
+
+// Deterministic synthetic catalogs. Authors follow a Zipf distribution so a
+// few prolific authors own many titles; titles are 2-6 words drawn with a
+// milder skew from a fixed vocabulary; ISBNs are valid, unique ISBN-13s.
+class CatalogGenerator {
+private:
+    static const vector<string> &firstNames() {
+        static const vector<string> names = {
+            "James", "Mary", "Robert", "Patricia", "John", "Jennifer", "Michael", "Linda",
+            "David", "Elizabeth", "William", "Barbara", "Richard", "Susan", "Joseph", "Jessica",
+            "Thomas", "Sarah", "Charles", "Karen", "Scott", "Nancy", "Bjarne", "Herb",
+            "Andrei", "Nicolai", "Anthony", "Kate", "Sean", "Klaus"};
+        return names;
+    }
+
+    static const vector<string> &lastNames() {
+        static const vector<string> names = {
+            "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+            "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson",
+            "Thomas", "Taylor", "Moore", "Jackson", "Martin", "Lee", "Perez", "Thompson",
+            "White", "Harris", "Sanchez", "Clark", "Ramirez", "Lewis", "Robinson", "Walker",
+            "Young", "Allen", "King", "Wright", "Scott", "Torres", "Nguyen", "Hill", "Flores",
+            "Meyers", "Stroustrup", "Sutter", "Alexandrescu", "Josuttis", "Gregory",
+            "Parent", "Iglberger", "Vandevoorde", "Knuth"};
+        return names;
+    }
+
+    static const vector<string> &vocabulary() {
+        static const vector<string> words = {
+            "The", "Modern", "C++", "Programming", "Guide", "Effective", "Design", "Patterns",
+            "Introduction", "Advanced", "Systems", "Concurrency", "Action", "Art", "Practice",
+            "Principles", "Data", "Structures", "Algorithms", "Performance", "Engineering",
+            "Software", "Architecture", "Clean", "Code", "Complete", "Reference", "Handbook",
+            "Secrets", "History", "World", "Night", "River", "Garden", "Shadow", "Light",
+            "Empire", "Journey", "Stone", "Winter", "Summer", "Fire", "Ocean", "Mountain",
+            "Silent", "Lost", "Hidden", "Last", "First", "City", "House", "Road", "Dream",
+            "Memory", "Machine", "Language", "Network", "Compiler", "Kernel", "Database",
+            "Security", "Testing", "Templates", "Metaprogramming", "Generic", "Functional",
+            "Parallel", "Distributed", "Embedded", "Graphics", "Game", "Physics", "Music"};
+        return words;
+    }
+
+    // Cumulative Zipf weights over ranks 1..n with exponent s
+    static vector<double> zipfCdf(size_t n, double s) {
+        vector<double> cdf(n);
+        double total = 0.0;
+        for (size_t rank = 1; rank <= n; ++rank) {
+            total += 1.0 / pow(static_cast<double>(rank), s);
+            cdf[rank - 1] = total;
+        }
+        for (double &value : cdf) {
+            value /= total;
+        }
+        return cdf;
+    }
+
+    static size_t draw(const vector<double> &cdf, double u) {
+        return min(cdf.size() - 1, static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+    }
+
+    static string authorName(size_t id) {
+        const auto &first = firstNames();
+        const auto &last = lastNames();
+        string name = first[id % first.size()] + " " + last[(id / first.size()) % last.size()];
+        size_t generation = id / (first.size() * last.size());
+        return generation == 0 ? name : name + " " + to_string(generation + 1);
+    }
+
+    static string isbn13(uint64_t serial) {
+        string digits = "978" + to_string(1000000000 + serial % 900000000).substr(1);
+        int sum = 0;
+        for (size_t i = 0; i < 12; ++i) {
+            sum += (digits[i] - '0') * (i % 2 ? 3 : 1);
+        }
+        return digits + static_cast<char>('0' + (10 - sum % 10) % 10);
+    }
+
+    mt19937_64 rng;
+    double authorSkew;
+
+public:
+    explicit CatalogGenerator(uint64_t seed = 42, double authorSkew = 1.1)
+        : rng(seed), authorSkew(authorSkew) {}
+
+    // n books with unique ISBNs (n < 9e8); one author per ~25 books on average
+    vector<Book> generate(size_t n) {
+        vector<double> authorCdf = zipfCdf(max<size_t>(10, n / 25), authorSkew);
+        vector<double> wordCdf = zipfCdf(vocabulary().size(), 0.8);
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        uniform_int_distribution<int> wordCount(2, 6);
+        exponential_distribution<double> age(1.0 / 15.0);
+        lognormal_distribution<double> price(3.2, 0.5);
+
+        // A stride coprime to the serial range spreads ISBNs out of insertion order
+        const uint64_t stride = 7919;
+        vector<Book> books;
+        books.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            string title;
+            for (int w = wordCount(rng); w > 0; --w) {
+                title += (title.empty() ? "" : " ") + vocabulary()[draw(wordCdf, unit(rng))];
+            }
+            int year = max(1900, 2024 - static_cast<int>(age(rng)));
+            double cost = round(min(500.0, 1.0 + price(rng)) * 100.0) / 100.0;
+            books.emplace_back(title, authorName(draw(authorCdf, unit(rng))), isbn13(i * stride), year, cost);
+        }
+        return books;
+    }
+
+    // A word likely to appear in generated titles
+    string titleQuery() {
+        static const vector<double> cdf = zipfCdf(vocabulary().size(), 0.8);
+        return vocabulary()[draw(cdf, uniform_real_distribution<double>(0.0, 1.0)(rng))];
+    }
+
+    // A last name that appears among the generated authors
+    string authorQuery() {
+        return lastNames()[rng() % lastNames().size()];
+    }
+
+    size_t index(size_t n) {
+        return rng() % n;
+    }
+};
+
+// Discards everything written to it; keeps the Library's messages out of the results
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+// Redirects cout to a NullBuffer for the lifetime of the object
+class SilenceCout {
+private:
+    NullBuffer sink;
+    streambuf *previous;
+
+public:
+    SilenceCout() : previous(cout.rdbuf(&sink)) {}
+    ~SilenceCout() {
+        cout.rdbuf(previous);
+    }
+};
+
+struct Options {
+    size_t minSize = 1000;
+    size_t maxSize = 10000000;
+    string filter;
+    uint64_t seed = 42;
+};
+
+Options options;
+
+bool selected(const string &name) {
+    return options.filter.empty() || name.find(options.filter) != string::npos;
+}
+
+// Print one result line; extra is appended verbatim (",\"key\":value,...")
+void report(const string &name, size_t size, size_t iterations, double seconds, const string &extra = "") {
+    printf("{\"schema\":1,\"benchmark\":\"%s\",\"size\":%zu,\"iterations\":%zu,\"seconds\":%.6f,"
+           "\"ns_per_op\":%.1f,\"ops_per_s\":%.1f%s}\n",
+           name.c_str(), size, iterations, seconds, seconds * 1e9 / max<size_t>(1, iterations),
+           iterations / max(seconds, 1e-12), extra.c_str());
+    fflush(stdout);
+}
+
+// Print a result that is a measurement of size rather than time
+// bytes counts everything reserved; used_bytes leaves out space reserved
+// ahead (e.g. the tail of an arena block), which dominates small catalogs
+void reportMemory(const string &name, size_t size, MemoryUsage usage) {
+    printf("{\"schema\":1,\"benchmark\":\"%s\",\"size\":%zu,\"bytes\":%zu,\"used_bytes\":%zu,\"allocations\":%zu}\n",
+           name.c_str(), size, usage.bytes, usage.bytes - usage.unusedBytes, usage.allocations);
+    fflush(stdout);
+}
+
+string throughput(size_t bytes, double seconds) {
+    char text[96];
+    snprintf(text, sizeof(text), ",\"bytes\":%zu,\"mb_per_s\":%.2f", bytes, bytes / max(seconds, 1e-12) / 1e6);
+    return text;
+}
+
+double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Run op(i) until the time budget or the iteration cap is reached; returns (iterations, seconds)
+template <typename Op>
+pair<size_t, double> measure(size_t maxIterations, Op op, double budget = 0.25) {
+    size_t iterations = 0;
+    auto start = Clock::now();
+    while (iterations < maxIterations) {
+        op(iterations++);
+        if ((iterations & 15) == 0 && secondsSince(start) >= budget) {
+            break;
+        }
+    }
+    return {iterations, secondsSince(start)};
+}
+
+size_t fileSize(const string &filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+}
+
+// Load the catalog the way loadBooksFromFile used to: one record at a time from the stream
+size_t loadRecordAtATime(Library &library, const string &filename) {
+    ifstream file(filename);
+    size_t loaded = 0;
+    while (file.peek() != ifstream::traits_type::eof()) {
+        loaded += library.addBook(Book::loadFromFile(file));
+    }
+    return loaded;
+}
+
+// Reader throughput against snapshots of a ConcurrentLibrary for 1, 2, 4, ... threads
+void benchmarkConcurrentReads(const Library &loaded, size_t size) {
+    ConcurrentLibrary library(loaded);
+    size_t maxThreads = max<unsigned>(1, thread::hardware_concurrency());
+
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        atomic<bool> done(false);
+        atomic<size_t> queries(0);
+        vector<thread> readers;
+        auto start = Clock::now();
+        for (size_t t = 0; t < threads; ++t) {
+            readers.emplace_back([&, t] {
+                CatalogGenerator queriesFor(options.seed + t);
+                size_t local = 0;
+                while (!done) {
+                    library.snapshot()->findByTitle(queriesFor.titleQuery(), 0, 50);
+                    ++local;
+                }
+                queries += local;
+            });
+        }
+        this_thread::sleep_for(chrono::milliseconds(250));
+        done = true;
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        report("concurrent_findByTitle_page", size, queries, secondsSince(start),
+               ",\"threads\":" + to_string(threads));
+    }
+}
+
+// Rows/sec of the catalog table and exports, all written to /dev/null. The
+// legacy path is the old displayAllBooks loop: setw per field, endl per row.
+void benchmarkRendering(const Library &library, const vector<Book> &catalog, size_t size) {
+    auto rows = [&](double seconds) {
+        char text[48];
+        snprintf(text, sizeof(text), ",\"rows_per_s\":%.1f", size / max(seconds, 1e-12));
+        return string(text);
+    };
+    auto timed = [&](const string &name, auto render) {
+        if (!selected(name)) {
+            return;
+        }
+        auto begin = Clock::now();
+        render();
+        double seconds = secondsSince(begin);
+        report(name, size, 1, seconds, rows(seconds));
+    };
+
+    ofstream devNull("/dev/null");
+    streambuf *previous = cout.rdbuf(devNull.rdbuf());
+    timed("render_legacy_setw_endl", [&] {
+        for (const auto &book : catalog) {
+            cout << left << setw(20) << book.title << setw(20) << book.author << setw(15) << book.isbn
+                 << setw(10) << book.year << setw(10) << book.price << endl;
+        }
+    });
+    timed("render_displayAllBooks", [&] { library.displayAllBooks(); });
+    cout.rdbuf(previous);
+
+    int fd = ::open("/dev/null", O_WRONLY);
+    timed("render_fd_table", [&] { library.renderAllBooks(fd); });
+    timed("export_csv", [&] { library.exportCsv(fd); });
+    timed("export_json_lines", [&] { library.exportJsonLines(fd); });
+    ::close(fd);
+}
+
+void runSize(size_t size) {
+    CatalogGenerator generator(options.seed);
+    vector<Book> catalog = generator.generate(size);
+    SilenceCout quiet;
+
+    Library library;
+    auto start = Clock::now();
+    for (const auto &book : catalog) {
+        library.addBook(book);
+    }
+    if (selected("addBook")) {
+        report("addBook", size, size, secondsSince(start));
+    }
+
+    if (selected("displayBookByISBN")) {
+        auto result = measure(100000, [&](size_t) {
+            library.displayBookByISBN(catalog[generator.index(size)].isbn);
+        });
+        report("displayBookByISBN", size, result.first, result.second);
+    }
+
+    if (selected("searchByTitle")) {
+        auto result = measure(1000, [&](size_t) { library.searchByTitle(generator.titleQuery()); });
+        report("searchByTitle", size, result.first, result.second);
+    }
+
+    if (selected("searchByAuthor")) {
+        auto result = measure(1000, [&](size_t) { library.searchByAuthor(generator.authorQuery()); });
+        report("searchByAuthor", size, result.first, result.second);
+    }
+
+    if (selected("cached_search")) {
+        library.enableQueryCache(256);
+        auto result = measure(100000, [&](size_t i) {
+            if (i % 2 == 0) {
+                library.searchByAuthor(generator.authorQuery());
+            } else {
+                library.searchByTitle(generator.titleQuery());
+            }
+        }, 2.0);
+        QueryCacheStats stats = library.queryCacheStats();
+        report("cached_search_mixed", size, result.first, result.second,
+               ",\"hit_rate\":" + to_string(double(stats.hits) / max<uint64_t>(1, stats.hits + stats.misses)));
+        library.enableQueryCache(0);
+    }
+
+    if (selected("aggregates")) {
+        Library copy = library;
+        auto begin = Clock::now();
+        copy.enableAggregates();
+        report("aggregates_enable", size, 1, secondsSince(begin));
+
+        auto result = measure(100000, [&](size_t) {
+            auto stats = copy.catalogAggregates().author(catalog[generator.index(size)].author);
+            static_cast<void>(stats);
+        });
+        report("aggregates_author_read", size, result.first, result.second);
+
+        result = measure(min<size_t>(size, 10000), [&](size_t i) {
+            Book book = catalog[(i * 7919) % size];
+            copy.removeBook(book.isbn);
+            copy.addBook(book);
+        });
+        report("aggregates_remove_add_pair", size, result.first, result.second);
+
+        begin = Clock::now();
+        CatalogAggregates recomputed = copy.recomputeAggregates();
+        double seconds = secondsSince(begin);
+        report("aggregates_recompute", size, 1, seconds,
+               string(",\"matches\":") + (recomputed.matches(copy.catalogAggregates()) ? "true" : "false"));
+    }
+
+    if (selected("query")) {
+        // author X published after 2010 under $40, first 20 by price
+        auto query = [&] {
+            return (Query::author(generator.authorQuery()) && Query::yearBetween(2011, INT_MAX) &&
+                    Query::priceBetween(0, 40)).orderBy(SortKey::Price).limit(20);
+        };
+        auto result = measure(1000, [&](size_t) { library.findWhere(query()); });
+        report("query_scan", size, result.first, result.second);
+        Library indexed = library;
+        indexed.enableSubstringIndex();
+        indexed.enableOrderedIndexes();
+        result = measure(1000, [&](size_t) { indexed.findWhere(query()); });
+        report("query_indexed", size, result.first, result.second);
+        result = measure(100000, [&](size_t i) {
+            indexed.findWhere(Query::isbn(catalog[(i * 7919) % size].isbn) && Query::priceBetween(0, 40));
+        });
+        report("query_isbn_point", size, result.first, result.second);
+    }
+
+    if (selected("sharded")) {
+        size_t threads = max(1u, thread::hardware_concurrency());
+        ShardedLibrary sharded(threads);
+        sharded.addBooks(catalog);
+        string extra = ",\"threads\":" + to_string(threads);
+        auto result = measure(1000, [&](size_t) { sharded.searchByTitle(generator.titleQuery()); });
+        report("sharded_searchByTitle", size, result.first, result.second, extra);
+        result = measure(1000, [&](size_t) { sharded.searchByAuthor(generator.authorQuery()); });
+        report("sharded_searchByAuthor", size, result.first, result.second, extra);
+        result = measure(100, [&](size_t) { sharded.rangeByPrice(10.0, 20.0); });
+        report("sharded_rangeByPrice", size, result.first, result.second, extra);
+        result = measure(1000, [&](size_t) { sharded.topK(SortKey::Price, 10); });
+        report("sharded_topK_price", size, result.first, result.second, extra);
+    }
+
+    if (selected("completeTitle")) {
+        Library indexed = library;
+        auto begin = Clock::now();
+        indexed.enableAutocomplete();
+        report("enableAutocomplete", size, 1, secondsSince(begin));
+        // Keystroke prefixes of a title word: 1, 2, 3 and 4 letters
+        auto prefix = [&](size_t i) { return generator.titleQuery().substr(0, 1 + i % 4); };
+        auto result = measure(10000, [&](size_t i) { indexed.completeTitle(prefix(i)); });
+        report("completeTitle", size, result.first, result.second);
+        result = measure(10000, [&](size_t i) {
+            string text = prefix(i) + "x";
+            indexed.addBook(Book(text, "Benchmark", "AC" + to_string(i), 2000, 1.0));
+            indexed.removeBook("AC" + to_string(i));
+        });
+        report("autocomplete_add_remove_pair", size, result.first, result.second);
+    }
+
+    if (selected("fuzzyFindByTitle")) {
+        // Two title words with one byte dropped, as a typo would
+        auto typo = [&] {
+            string query = generator.titleQuery() + " " + generator.titleQuery();
+            return query.erase(generator.index(query.size()), 1);
+        };
+        auto result = measure(1000, [&](size_t) { library.fuzzyFindByTitle(typo(), 1); });
+        report("fuzzyFindByTitle_scan", size, result.first, result.second);
+
+        Library indexed = library;
+        indexed.enableFuzzyIndex();
+        result = measure(1000, [&](size_t) { indexed.fuzzyFindByTitle(typo(), 1); });
+        report("fuzzyFindByTitle_index", size, result.first, result.second);
+    }
+
+    const pair<const char *, SortAlgorithm> sortAlgorithms[] = {
+        {"", SortAlgorithm::Auto},
+        {"_comparison", SortAlgorithm::Comparison},
+        {"_radix", SortAlgorithm::Radix},
+        {"_parallel_radix", SortAlgorithm::ParallelRadix},
+    };
+    for (const string field : {"sortByPrice", "sortByYear"}) {
+        for (const auto &algorithm : sortAlgorithms) {
+            string name = field + algorithm.first;
+            if (!selected(name)) {
+                continue;
+            }
+            double seconds = 0.0;
+            size_t iterations = 0;
+            while (iterations < 5 && seconds < 0.25) {
+                Library copy = library; // Every run sorts the unsorted catalog
+                auto begin = Clock::now();
+                field == "sortByPrice" ? copy.sortByPrice(algorithm.second) : copy.sortByYear(algorithm.second);
+                seconds += secondsSince(begin);
+                ++iterations;
+            }
+            report(name, size, iterations, seconds);
+        }
+    }
+
+    string filename = "benchmark_catalog.txt";
+    if (selected("saveBooksToFile") || selected("loadBooksFromFile") || selected("load_text")) {
+        auto begin = Clock::now();
+        library.saveBooksToFile(filename);
+        double seconds = secondsSince(begin);
+        size_t bytes = fileSize(filename);
+        if (selected("saveBooksToFile")) {
+            report("saveBooksToFile", size, 1, seconds, throughput(bytes, seconds));
+        }
+
+        if (selected("saveBooksToFileAsync")) {
+            // The caller only pays for the point-in-time copy; the write runs behind it
+            begin = Clock::now();
+            auto pending = library.saveBooksToFileAsync(filename + ".async");
+            double stall = secondsSince(begin);
+            SaveResult saved = pending.get();
+            report("saveBooksToFileAsync_caller_stall", size, 1, stall,
+                   ",\"total_seconds\":" + to_string(secondsSince(begin)) +
+                   ",\"ok\":" + (saved.ok ? "true" : "false"));
+            remove((filename + ".async").c_str());
+        }
+
+        if (selected("loadBooksFromFile")) {
+            for (size_t threads : {size_t(1), size_t(0)}) {
+                Library loaded;
+                begin = Clock::now();
+                loaded.loadBooksFromFile(filename, threads);
+                seconds = secondsSince(begin);
+                report(threads == 1 ? "loadBooksFromFile_1_thread" : "loadBooksFromFile_all_threads",
+                       size, 1, seconds, throughput(bytes, seconds));
+            }
+        }
+
+        if (selected("load_text_record_at_a_time")) {
+            Library loaded;
+            begin = Clock::now();
+            loadRecordAtATime(loaded, filename);
+            seconds = secondsSince(begin);
+            report("load_text_record_at_a_time", size, 1, seconds, throughput(bytes, seconds));
+        }
+        remove(filename.c_str());
+    }
+
+    if (selected("removeBook")) {
+        Library copy = library;
+        auto result = measure(min<size_t>(size / 2, 1000), [&](size_t i) {
+            copy.removeBook(catalog[(i * 7919) % size].isbn);
+        });
+        report("removeBook", size, result.first, result.second);
+
+        // Handle removals run on a fresh copy, on books the loop above did not
+        // touch, so every handle is live and every call does the full removal
+        vector<bool> removedByIsbn(size, false);
+        for (size_t i = 0; i < result.first; ++i) {
+            removedByIsbn[(i * 7919) % size] = true;
+        }
+        vector<size_t> picks;
+        for (size_t i = 0; i < size; ++i) {
+            if (!removedByIsbn[i]) {
+                picks.push_back(i);
+            }
+        }
+        shuffle(picks.begin(), picks.end(), mt19937_64(size));
+        picks.resize(min<size_t>(picks.size(), 100000));
+
+        Library handleCopy = library;
+        vector<BookHandle> handles;
+        for (size_t pick : picks) {
+            handles.push_back(handleCopy.handleOf(catalog[pick].isbn));
+        }
+        size_t removed = 0;
+        result = measure(handles.size(), [&](size_t i) { removed += handleCopy.removeBook(handles[i]); });
+        if (removed != result.first) {
+            fprintf(stderr, "removeBook_handle: %zu of %zu removals failed\n", result.first - removed, result.first);
+            exit(1);
+        }
+        report("removeBook_handle", size, result.first, result.second);
+    }
+
+    if (selected("render") || selected("export")) {
+        benchmarkRendering(library, catalog, size);
+    }
+
+    if (selected("memory")) {
+        reportMemory("memory_std_string", size, library.bookMemoryUsage());
+        reportMemory("memory_arena_interned", size, library.toCompactCatalog().memoryUsage());
+    }
+
+    if (selected("concurrent")) {
+        benchmarkConcurrentReads(library, size);
+    }
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (flag == "--min-size") {
+            options.minSize = stoull(argv[i + 1]);
+        } else if (flag == "--max-size") {
+            options.maxSize = stoull(argv[i + 1]);
+        } else if (flag == "--filter") {
+            options.filter = argv[i + 1];
+        } else if (flag == "--seed") {
+            options.seed = stoull(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    for (size_t size = 1000; size <= options.maxSize; size *= 10) {
+        if (size >= options.minSize) {
+            runSize(size);
+        }
+    }
+    return 0;
+}
@@ -5,8 +5,39 @@
 #include <algorithm>
 #include <iomanip>
 #include <limits>
+#include <climits>
 #include <sstream>  // For stringstream manipulation
 #include <optional>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 using namespace std;
@@ -33,7 +64,7 @@ public:
              << setw(20) << author
              << setw(15) << isbn
              << setw(10) << year
-             << setw(10) << price << endl;
+             << setw(10) << price << '\n';
     }
 
     // Save book data to a file
@@ -57,127 +88,4585 @@ public:
     }
 };
 
+// Canonical ISBN packed into 64 bits: the 13-digit ISBN-13 value, with
+// ISBN-10s converted to their 978 form. Hyphens and spaces are ignored and
+// the check digit must be valid. Orders like the canonical ISBN-13 string.
+class IsbnKey {
+private:
+    uint64_t value = 0;
+
+    explicit IsbnKey(uint64_t v) : value(v) {}
+
+public:
+    IsbnKey() = default;
+
+    // Parse an ISBN-10 or ISBN-13; nullopt for anything else
+    static optional<IsbnKey> parse(string_view text) {
+        int digits[13];
+        size_t count = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (c == '-' || c == ' ') {
+                continue;
+            }
+            if (count == 13) {
+                return nullopt;
+            }
+            if (c >= '0' && c <= '9') {
+                digits[count++] = c - '0';
+            } else if (c == 'X' || c == 'x') {
+                digits[count++] = 10;  // Only valid as an ISBN-10 check digit, checked below
+            } else {
+                return nullopt;
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (digits[i] == 10 && !(count == 10 && i == 9)) {
+                return nullopt;
+            }
+        }
+
+        uint64_t packed = 0;
+        if (count == 10) {
+            int sum = 0;
+            for (int i = 0; i < 10; ++i) {
+                sum += (10 - i) * digits[i];
+            }
+            if (sum % 11 != 0) {
+                return nullopt;
+            }
+            int check = 9 + 7 * 3 + 8;  // weighted "978" prefix
+            packed = 978;
+            for (int i = 0; i < 9; ++i) {
+                check += digits[i] * (i % 2 == 0 ? 3 : 1);
+                packed = packed * 10 + digits[i];
+            }
+            return IsbnKey(packed * 10 + (10 - check % 10) % 10);
+        }
+        if (count != 13 || digits[0] != 9 || digits[1] != 7 ||
+            (digits[2] != 8 && digits[2] != 9)) {
+            return nullopt;
+        }
+        int sum = 0;
+        for (int i = 0; i < 13; ++i) {
+            sum += digits[i] * (i % 2 == 0 ? 1 : 3);
+            packed = packed * 10 + digits[i];
+        }
+        if (sum % 10 != 0) {
+            return nullopt;
+        }
+        return IsbnKey(packed);
+    }
+
+    // True if a and b name the same book: equal keys when both are valid
+    // ISBNs, byte-for-byte equal otherwise
+    static bool same(const string &a, const string &b) {
+        auto ka = parse(a);
+        auto kb = ka ? parse(b) : nullopt;
+        return ka && kb ? *ka == *kb : a == b;
+    }
+
+    uint64_t packed() const { return value; }
+
+    // Hyphen-free ISBN-13 form
+    string toString() const {
+        return to_string(value);
+    }
+
+    bool operator==(IsbnKey other) const { return value == other.value; }
+    bool operator!=(IsbnKey other) const { return value != other.value; }
+    bool operator<(IsbnKey other) const { return value < other.value; }
+};
+
+namespace std {
+template <>
+struct hash<IsbnKey> {
+    // ISBNs share long prefixes, so mix the bits before bucketing
+    size_t operator()(IsbnKey key) const {
+        uint64_t x = key.packed() * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(x ^ (x >> 32));
+    }
+};
+}
+
+// Fixed-size pool of worker threads
+class ThreadPool {
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex queueMutex;
+    condition_variable ready;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    // Start the given number of workers; 0 means one per hardware thread
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) {
+            threads = max<size_t>(1, thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Finish the queued tasks and join the workers
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Queue a task; its result (or exception) is delivered through the future
+    template <typename Task>
+    auto submit(Task task) -> future<decltype(task())> {
+        auto packaged = make_shared<packaged_task<decltype(task())()>>(std::move(task));
+        future<decltype(task())> result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            tasks.emplace([packaged] { (*packaged)(); });
+        }
+        ready.notify_one();
+        return result;
+    }
+};
+
+// Opt-in per-operation metrics. Build with -DLIBRARY_INSTRUMENTATION to have
+// LIBRARY_TRACE time each public Library operation and LIBRARY_RECORD attribute
+// bytes and item counts to the innermost traced operation on the calling
+// thread; otherwise both macros expand to nothing. Each thread writes its own
+// counters, so recording never contends; snapshot() merges all threads.
+class Instrumentation {
+public:
+    enum Counter { BytesRead, BytesWritten, Scanned, Returned, CounterCount };
+
+    // Latencies in nanoseconds are bucketed HDR-style: exact below 8, then 8
+    // sub-buckets per power of two (at most 12.5% relative error)
+    static constexpr size_t subBucketBits = 3;
+    static constexpr size_t subBuckets = size_t(1) << subBucketBits;
+    static constexpr size_t histogramBuckets = subBuckets * (64 - subBucketBits + 1);
+    static constexpr size_t maxOperations = 128;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    static size_t bucketOf(uint64_t nanos) {
+        if (nanos < subBuckets) {
+            return static_cast<size_t>(nanos);
+        }
+        size_t msb = 63 - static_cast<size_t>(__builtin_clzll(nanos));
+        size_t sub = static_cast<size_t>(nanos >> (msb - subBucketBits)) & (subBuckets - 1);
+        return subBuckets * (msb - subBucketBits + 1) + sub;
+    }
+
+    // Largest latency that falls into a bucket
+    static uint64_t bucketUpperBound(size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+        size_t msb = bucket / subBuckets + subBucketBits - 1;
+        uint64_t low = uint64_t(subBuckets + bucket % subBuckets) << (msb - subBucketBits);
+        return low + (uint64_t(1) << (msb - subBucketBits)) - 1;
+    }
+
+    // Totals for one operation across all threads
+    struct OperationStats {
+        string name;
+        uint64_t calls = 0;
+        uint64_t totalNanos = 0;
+        uint64_t maxNanos = 0;
+        uint64_t counters[CounterCount] = {};
+        vector<uint64_t> histogram = vector<uint64_t>(histogramBuckets);
+
+        double meanNanos() const {
+            return calls ? static_cast<double>(totalNanos) / calls : 0.0;
+        }
+
+        // Latency at quantile q (0..1), accurate to the bucket width
+        uint64_t percentile(double q) const {
+            uint64_t rank = static_cast<uint64_t>(ceil(q * calls));
+            uint64_t seen = 0;
+            for (size_t b = 0; b < histogram.size(); ++b) {
+                seen += histogram[b];
+                if (seen >= max<uint64_t>(rank, 1)) {
+                    return min(bucketUpperBound(b), maxNanos);
+                }
+            }
+            return maxNanos;
+        }
+    };
+
+private:
+    // Written only by the owning thread; atomics keep concurrent snapshots race-free
+    struct Slot {
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> totalNanos{0};
+        atomic<uint64_t> maxNanos{0};
+        atomic<uint64_t> counters[CounterCount] = {};
+        atomic<uint64_t> histogram[histogramBuckets] = {};
+    };
+
+    // One per thread, plus one holding the totals of threads that have exited
+    struct ThreadCounters {
+        atomic<Slot *> slots[maxOperations] = {};
+
+        ~ThreadCounters() {
+            for (auto &slot : slots) {
+                delete slot.load();
+            }
+        }
+
+        Slot &slot(size_t op) {
+            Slot *slot = slots[op].load(memory_order_acquire);
+            if (!slot) {
+                slot = new Slot();
+                slots[op].store(slot, memory_order_release);
+            }
+            return *slot;
+        }
+
+        // Add other's totals; the caller keeps other from being written meanwhile
+        void merge(const ThreadCounters &other) {
+            for (size_t op = 0; op < maxOperations; ++op) {
+                const Slot *from = other.slots[op].load(memory_order_acquire);
+                if (!from) {
+                    continue;
+                }
+                Slot &to = slot(op);
+                bump(to.calls, from->calls.load(memory_order_relaxed));
+                bump(to.totalNanos, from->totalNanos.load(memory_order_relaxed));
+                to.maxNanos.store(max(to.maxNanos.load(memory_order_relaxed),
+                                      from->maxNanos.load(memory_order_relaxed)),
+                                  memory_order_relaxed);
+                for (size_t c = 0; c < CounterCount; ++c) {
+                    bump(to.counters[c], from->counters[c].load(memory_order_relaxed));
+                }
+                for (size_t b = 0; b < histogramBuckets; ++b) {
+                    bump(to.histogram[b], from->histogram[b].load(memory_order_relaxed));
+                }
+            }
+        }
+    };
+
+    struct Registry {
+        mutex lock;
+        vector<string> names;
+        vector<ThreadCounters *> threads; // Live threads only
+        ThreadCounters retired;           // Folded in from exited threads
+
+        // Every set of counters, live and retired
+        vector<ThreadCounters *> all() {
+            vector<ThreadCounters *> counters = threads;
+            counters.push_back(&retired);
+            return counters;
+        }
+    };
+
+    static Registry &registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    // A thread's counters; on thread exit they are folded into the retired
+    // totals and dropped from the registry, so exited threads cost nothing
+    class ThreadOwner {
+    private:
+        ThreadCounters counters;
+
+    public:
+        ThreadOwner() {
+            lock_guard<mutex> guard(registry().lock);
+            registry().threads.push_back(&counters);
+        }
+
+        ~ThreadOwner() {
+            Registry &reg = registry();
+            lock_guard<mutex> guard(reg.lock);
+            reg.retired.merge(counters);
+            reg.threads.erase(find(reg.threads.begin(), reg.threads.end(), &counters));
+        }
+
+        ThreadCounters &get() {
+            return counters;
+        }
+    };
+
+    static ThreadCounters &local() {
+        thread_local ThreadOwner owner;
+        return owner.get();
+    }
+
+    static void bump(atomic<uint64_t> &value, uint64_t n) {
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+public:
+    class Scope;
+
+    // Innermost traced operation running on this thread, if any
+    static Scope *&current() {
+        thread_local Scope *scope = nullptr;
+        return scope;
+    }
+
+    // Times one call of an operation and collects the counters recorded during it
+    class Scope {
+    private:
+        Slot *slot;
+        Scope *outer;
+        chrono::steady_clock::time_point start;
+
+    public:
+        explicit Scope(size_t op)
+            : slot(op == npos ? nullptr : &local().slot(op)), outer(current()),
+              start(chrono::steady_clock::now()) {
+            current() = this;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope() {
+            current() = outer;
+            if (!slot) {
+                return;
+            }
+            uint64_t nanos = static_cast<uint64_t>(
+                chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            bump(slot->calls, 1);
+            bump(slot->totalNanos, nanos);
+            if (nanos > slot->maxNanos.load(memory_order_relaxed)) {
+                slot->maxNanos.store(nanos, memory_order_relaxed);
+            }
+            bump(slot->histogram[bucketOf(nanos)], 1);
+        }
+
+        void add(Counter counter, uint64_t n) {
+            if (slot) {
+                bump(slot->counters[counter], n);
+            }
+        }
+    };
+
+    // Id for an operation name; the same name always maps to the same id.
+    // Returns npos (and the operation goes unrecorded) past maxOperations.
+    static size_t registerOperation(const string &name) {
+        Registry &reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        auto it = find(reg.names.begin(), reg.names.end(), name);
+        if (it != reg.names.end()) {
+            return static_cast<size_t>(it - reg.names.begin());
+        }
+        if (reg.names.size() == maxOperations) {
+            return npos;
+        }
+        reg.names.push_back(name);
+        return reg.names.size() - 1;
+    }
+
+    // Threads whose counters are tracked individually; exited threads are
+    // folded into a single retired total and no longer counted
+    static size_t liveThreads() {
+        Registry &reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        return reg.threads.size();
+    }
+
+    // Add n to a counter of the innermost traced operation on this thread
+    static void record(Counter counter, uint64_t n) {
+        if (Scope *scope = current()) {
+            scope->add(counter, n);
+        }
+    }
+
+    // Merged totals of every operation called at least once, in registration order
+    static vector<OperationStats> snapshot() {
+        Registry &reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        vector<OperationStats> stats(reg.names.size());
+        for (size_t op = 0; op < stats.size(); ++op) {
+            stats[op].name = reg.names[op];
+            for (const ThreadCounters *thread : reg.all()) {
+                const Slot *slot = thread->slots[op].load(memory_order_acquire);
+                if (!slot) {
+                    continue;
+                }
+                stats[op].calls += slot->calls.load(memory_order_relaxed);
+                stats[op].totalNanos += slot->totalNanos.load(memory_order_relaxed);
+                stats[op].maxNanos = max(stats[op].maxNanos, slot->maxNanos.load(memory_order_relaxed));
+                for (size_t c = 0; c < CounterCount; ++c) {
+                    stats[op].counters[c] += slot->counters[c].load(memory_order_relaxed);
+                }
+                for (size_t b = 0; b < histogramBuckets; ++b) {
+                    stats[op].histogram[b] += slot->histogram[b].load(memory_order_relaxed);
+                }
+            }
+        }
+        stats.erase(remove_if(stats.begin(), stats.end(), [](const OperationStats &s) {
+            return s.calls == 0;
+        }), stats.end());
+        return stats;
+    }
+
+    // Zero every counter; call while no traced operation is running
+    static void reset() {
+        Registry &reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        for (ThreadCounters *thread : reg.all()) {
+            for (auto &entry : thread->slots) {
+                if (Slot *slot = entry.load(memory_order_acquire)) {
+                    slot->calls = 0;
+                    slot->totalNanos = 0;
+                    slot->maxNanos = 0;
+                    for (auto &counter : slot->counters) {
+                        counter = 0;
+                    }
+                    for (auto &bucket : slot->histogram) {
+                        bucket = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // Write a snapshot as an aligned text table
+    static void dumpText(ostream &out) {
+        out << left << setw(26) << "Operation" << right << setw(10) << "Calls" << setw(12) << "Mean ns"
+            << setw(12) << "p50 ns" << setw(12) << "p99 ns" << setw(12) << "Max ns" << setw(12) << "Scanned"
+            << setw(12) << "Returned" << setw(14) << "Bytes read" << setw(14) << "Bytes written" << endl;
+        for (const auto &s : snapshot()) {
+            out << left << setw(26) << s.name << right << setw(10) << s.calls << setw(12)
+                << static_cast<uint64_t>(s.meanNanos()) << setw(12) << s.percentile(0.5) << setw(12)
+                << s.percentile(0.99) << setw(12) << s.maxNanos << setw(12) << s.counters[Scanned] << setw(12)
+                << s.counters[Returned] << setw(14) << s.counters[BytesRead] << setw(14)
+                << s.counters[BytesWritten] << endl;
+        }
+        out << left;
+    }
+
+    // Write a snapshot as one JSON object; histograms list only non-empty
+    // buckets as [upper bound ns, count] pairs
+    static void dumpJson(ostream &out) {
+        out << "{\"operations\":[";
+        bool first = true;
+        for (const auto &s : snapshot()) {
+            out << (first ? "" : ",") << "{\"name\":\"" << s.name << "\",\"calls\":" << s.calls
+                << ",\"total_ns\":" << s.totalNanos << ",\"max_ns\":" << s.maxNanos
+                << ",\"p50_ns\":" << s.percentile(0.5) << ",\"p90_ns\":" << s.percentile(0.9)
+                << ",\"p99_ns\":" << s.percentile(0.99) << ",\"scanned\":" << s.counters[Scanned]
+                << ",\"returned\":" << s.counters[Returned] << ",\"bytes_read\":" << s.counters[BytesRead]
+                << ",\"bytes_written\":" << s.counters[BytesWritten] << ",\"histogram\":[";
+            bool firstBucket = true;
+            for (size_t b = 0; b < s.histogram.size(); ++b) {
+                if (s.histogram[b]) {
+                    out << (firstBucket ? "" : ",") << "[" << bucketUpperBound(b) << "," << s.histogram[b] << "]";
+                    firstBucket = false;
+                }
+            }
+            out << "]}";
+            first = false;
+        }
+        out << "]}" << endl;
+    }
+};
+
+#ifdef LIBRARY_INSTRUMENTATION
+#define LIBRARY_TRACE(name)                                                                  \
+    static const size_t libraryTraceOp = Instrumentation::registerOperation(name);          \
+    Instrumentation::Scope libraryTraceScope(libraryTraceOp)
+#define LIBRARY_RECORD(counter, n) Instrumentation::record(Instrumentation::counter, (n))
+#else
+#define LIBRARY_TRACE(name) static_cast<void>(0)
+#define LIBRARY_RECORD(counter, n) static_cast<void>(0)
+#endif
+
+// Collects formatted output in large chunks and hands each chunk to a file
+// descriptor (or an ostream) in one write, instead of flushing row by row
+class BufferedWriter {
+private:
+    int fd = -1;
+    ostream *stream = nullptr;
+    string buffer;
+    size_t chunkSize;
+    bool failed = false;
+
+    BufferedWriter &spill() {
+        if (buffer.size() >= chunkSize) {
+            flush();
+        }
+        return *this;
+    }
+
+public:
+    static constexpr size_t defaultChunkSize = 1 << 20;
+
+    explicit BufferedWriter(int fd, size_t chunkSize = defaultChunkSize) : fd(fd), chunkSize(chunkSize) {
+        buffer.reserve(chunkSize + 256);
+    }
+
+    explicit BufferedWriter(ostream &stream, size_t chunkSize = defaultChunkSize)
+        : stream(&stream), chunkSize(chunkSize) {
+        buffer.reserve(chunkSize + 256);
+    }
+
+    BufferedWriter(const BufferedWriter &) = delete;
+    BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+    ~BufferedWriter() {
+        flush();
+    }
+
+    BufferedWriter &write(string_view text) {
+        buffer.append(text.data(), text.size());
+        return spill();
+    }
+
+    BufferedWriter &write(char c) {
+        buffer += c;
+        return spill();
+    }
+
+    // Text left-aligned in a field of width characters, like left << setw(width)
+    BufferedWriter &padded(string_view text, size_t width) {
+        buffer.append(text.data(), text.size());
+        if (text.size() < width) {
+            buffer.append(width - text.size(), ' ');
+        }
+        return spill();
+    }
+
+    BufferedWriter &padded(long long value, size_t width) {
+        char text[24];
+        return padded(string_view(text, to_chars(text, text + sizeof(text), value).ptr - text), width);
+    }
+
+    // Doubles as an ostream prints them by default (6 significant digits)
+    BufferedWriter &padded(double value, size_t width) {
+        char text[32];
+        int length = snprintf(text, sizeof(text), "%g", value);
+        return padded(string_view(text, length), width);
+    }
+
+    BufferedWriter &number(long long value) {
+        return padded(value, 0);
+    }
+
+    // Shortest text that parses back to the same double
+    BufferedWriter &number(double value) {
+        char text[32];
+        return write(string_view(text, to_chars(text, text + sizeof(text), value).ptr - text));
+    }
+
+    // A CSV field, quoted (with quotes doubled) only when it needs to be
+    BufferedWriter &csvField(string_view text) {
+        if (text.find_first_of(",\"\r\n") == string_view::npos) {
+            return write(text);
+        }
+        buffer += '"';
+        for (char c : text) {
+            buffer.append(c == '"' ? 2 : 1, c);
+        }
+        buffer += '"';
+        return spill();
+    }
+
+    // A quoted JSON string with quotes, backslashes and control characters escaped
+    BufferedWriter &jsonString(string_view text) {
+        buffer += '"';
+        for (char c : text) {
+            switch (c) {
+            case '"': buffer += "\\\""; break;
+            case '\\': buffer += "\\\\"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\t': buffer += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    buffer += escaped;
+                } else {
+                    buffer += c;
+                }
+            }
+        }
+        buffer += '"';
+        return spill();
+    }
+
+    // Hand the buffered bytes to the sink; returns false once any write failed
+    bool flush() {
+        if (!buffer.empty() && !failed) {
+            if (stream) {
+                failed = !stream->write(buffer.data(), buffer.size());
+            } else {
+                const char *cursor = buffer.data();
+                size_t left = buffer.size();
+                while (left > 0) {
+                    ssize_t written = ::write(fd, cursor, left);
+                    if (written < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        failed = true;
+                        break;
+                    }
+                    cursor += written;
+                    left -= written;
+                }
+            }
+            LIBRARY_RECORD(BytesWritten, buffer.size());
+        }
+        buffer.clear();
+        return !failed;
+    }
+
+    bool ok() const {
+        return !failed;
+    }
+};
+
+// One row of the catalog table, formatted exactly like Book::display
+void writeBookRow(BufferedWriter &out, const Book &book) {
+    out.padded(book.title, 20)
+        .padded(book.author, 20)
+        .padded(book.isbn, 15)
+        .padded(static_cast<long long>(book.year), 10)
+        .padded(book.price, 10)
+        .write('\n');
+}
+
+// Header and rows of the table printed by Library::displayAllBooks
+template <typename Books>
+void writeBookTable(BufferedWriter &out, const Books &books) {
+    out.padded("Title", 20).padded("Author", 20).padded("ISBN", 15).padded("Year", 10).padded("Price", 10).write('\n');
+    for (const auto &book : books) {
+        writeBookRow(out, book);
+    }
+}
+
+// RFC 4180 CSV with a header line; prices round-trip exactly
+template <typename Books>
+void writeBooksCsv(BufferedWriter &out, const Books &books) {
+    out.write("title,author,isbn,year,price\r\n");
+    for (const auto &book : books) {
+        out.csvField(book.title).write(',').csvField(book.author).write(',').csvField(book.isbn).write(',');
+        out.number(static_cast<long long>(book.year)).write(',').number(book.price).write("\r\n");
+    }
+}
+
+// One JSON object per line; non-finite prices are written as null
+template <typename Books>
+void writeBooksJsonLines(BufferedWriter &out, const Books &books) {
+    for (const auto &book : books) {
+        out.write("{\"title\":").jsonString(book.title);
+        out.write(",\"author\":").jsonString(book.author);
+        out.write(",\"isbn\":").jsonString(book.isbn);
+        out.write(",\"year\":").number(static_cast<long long>(book.year));
+        out.write(",\"price\":");
+        if (isfinite(book.price)) {
+            out.number(book.price);
+        } else {
+            out.write("null");
+        }
+        out.write("}\n");
+    }
+}
+
+// A record that could not be loaded, with the 1-based line it starts on
+struct LoadError {
+    size_t line;
+    string message;
+};
+
+// Outcome of loading a catalog file
+struct LoadReport {
+    size_t loaded = 0;
+    size_t replayed = 0; // Journal records applied after the snapshot
+    uint64_t tornJournalBytes = 0; // Journal bytes after the last valid record, ignored
+    vector<LoadError> errors;
+};
+
+// Books parsed from one chunk of a text catalog, with the line each record starts on
+struct ParsedChunk {
+    vector<Book> books;
+    vector<size_t> lines;
+    vector<LoadError> errors;
+};
+
+// Parse whole five-line records from [begin, end); firstLine is the line number of begin.
+// Calls emit(title, author, isbn, year, price, line) for each valid record, with the
+// string fields viewing the input, and appends malformed records to errors.
+template <typename Emit>
+void parseCatalogRecords(const char *begin, const char *end, size_t firstLine,
+                         vector<LoadError> &errors, Emit emit) {
+    string_view fields[5];
+    size_t line = firstLine;
+
+    auto trimmed = [](string_view text) {
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.front()))) {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.back()))) {
+            text.remove_suffix(1);
+        }
+        return text;
+    };
+
+    const char *cursor = begin;
+    while (cursor < end) {
+        size_t recordLine = line;
+        size_t count = 0;
+        while (count < 5 && cursor < end) {
+            const char *newline = static_cast<const char *>(memchr(cursor, '\n', end - cursor));
+            const char *lineEnd = newline ? newline : end;
+            fields[count++] = string_view(cursor, lineEnd - cursor);
+            cursor = newline ? newline + 1 : end;
+            ++line;
+        }
+
+        if (count < 5) {
+            bool blank = true;
+            for (size_t i = 0; i < count; ++i) {
+                blank = blank && trimmed(fields[i]).empty();
+            }
+            if (!blank) {
+                errors.push_back({recordLine, "incomplete record (" + to_string(count) + " of 5 lines)"});
+            }
+            break;
+        }
+
+        string_view yearText = trimmed(fields[3]);
+        string_view priceText = trimmed(fields[4]);
+        int year = 0;
+        double price = 0.0;
+        auto yearResult = from_chars(yearText.data(), yearText.data() + yearText.size(), year);
+        auto priceResult = from_chars(priceText.data(), priceText.data() + priceText.size(), price);
+        if (yearText.empty() || yearResult.ec != errc() || yearResult.ptr != yearText.data() + yearText.size()) {
+            errors.push_back({recordLine + 3, "invalid year '" + string(fields[3]) + "'"});
+            continue;
+        }
+        // from_chars also accepts "nan" and "inf", which no price can be
+        if (priceText.empty() || priceResult.ec != errc() || priceResult.ptr != priceText.data() + priceText.size() ||
+            !isfinite(price)) {
+            errors.push_back({recordLine + 4, "invalid price '" + string(fields[4]) + "'"});
+            continue;
+        }
+
+        emit(fields[0], fields[1], fields[2], year, price, recordLine);
+    }
+}
+
+// Parse a chunk of a text catalog into Books
+ParsedChunk parseCatalogChunk(const char *begin, const char *end, size_t firstLine) {
+    ParsedChunk chunk;
+    parseCatalogRecords(begin, end, firstLine, chunk.errors,
+                        [&](string_view title, string_view author, string_view isbn, int year,
+                            double price, size_t line) {
+        chunk.books.emplace_back(string(title), string(author), string(isbn), year, price);
+        chunk.lines.push_back(line);
+    });
+    return chunk;
+}
+
+// Append-only log of catalog mutations kept next to a text snapshot.
+//
+// Each record is: op (1 byte), payload length (uint32), payload, FNV-1a
+// checksum of op + payload (uint32). String fields in the payload are
+// length-prefixed with a uint32. Records are buffered and written with one
+// fsync per batch; a torn or corrupt tail is ignored on replay.
+class Journal {
+public:
+    enum Op : char { Add = 'A', Remove = 'R', Update = 'U', Clear = 'C' };
+
+    struct Record {
+        Op op;
+        Book book; // Remove only carries the ISBN
+    };
+
+private:
+    int fd = -1;
+    string buffer;
+    size_t pendingOps = 0;
+    size_t batchSize;
+    uint64_t fileBytes = 0;
+
+    static uint32_t checksum(const char *data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    static void put(string &out, T value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static void putString(string &out, const string &text) {
+        put<uint32_t>(out, static_cast<uint32_t>(text.size()));
+        out += text;
+    }
+
+    template <typename T>
+    static bool get(const char *&cursor, const char *end, T &value) {
+        if (static_cast<size_t>(end - cursor) < sizeof(value)) {
+            return false;
+        }
+        memcpy(&value, cursor, sizeof(value));
+        cursor += sizeof(value);
+        return true;
+    }
+
+    static bool getString(const char *&cursor, const char *end, string &text) {
+        uint32_t size;
+        if (!get(cursor, end, size) || static_cast<size_t>(end - cursor) < size) {
+            return false;
+        }
+        text.assign(cursor, size);
+        cursor += size;
+        return true;
+    }
+
+public:
+    explicit Journal(size_t batchSize) : batchSize(max<size_t>(1, batchSize)) {}
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    ~Journal() {
+        flush();
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    // Open (or create) the journal file for appending. A torn or corrupt
+    // tail is cut off first, so new records follow the last valid one and
+    // stay readable on the next replay.
+    bool open(const string &path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        uint64_t validBytes = 0;
+        read(path, &validBytes);
+        if (static_cast<uint64_t>(st.st_size) > validBytes &&
+            (ftruncate(fd, validBytes) != 0 || fdatasync(fd) != 0)) {
+            return false;
+        }
+        fileBytes = validBytes;
+        return true;
+    }
+
+    // Bytes in the journal, including records not yet flushed
+    uint64_t size() const {
+        return fileBytes + buffer.size();
+    }
+
+    // Buffer a record, flushing once batchSize records are pending; returns
+    // false if that flush failed
+    bool append(Op op, const Book &book) {
+        string payload;
+        if (op == Remove) {
+            putString(payload, book.isbn);
+        } else if (op != Clear) {
+            putString(payload, book.title);
+            putString(payload, book.author);
+            putString(payload, book.isbn);
+            put<int32_t>(payload, book.year);
+            put<double>(payload, book.price);
+        }
+
+        size_t start = buffer.size();
+        buffer += static_cast<char>(op);
+        put<uint32_t>(buffer, static_cast<uint32_t>(payload.size()));
+        buffer += payload;
+        put<uint32_t>(buffer, checksum(buffer.data() + start, buffer.size() - start));
+
+        if (++pendingOps >= batchSize) {
+            return flush();
+        }
+        return true;
+    }
+
+    // Write buffered records and fsync them; returns false on I/O failure.
+    // Bytes already written are dropped from the buffer, so a retry resumes
+    // mid-record instead of leaving a torn record followed by a duplicate.
+    bool flush() {
+        if (fd < 0 || buffer.empty()) {
+            return true;
+        }
+        size_t done = 0;
+        while (done < buffer.size()) {
+            ssize_t written = ::write(fd, buffer.data() + done, buffer.size() - done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            done += written;
+        }
+        LIBRARY_RECORD(BytesWritten, done);
+        fileBytes += done;
+        buffer.erase(0, done);
+        if (!buffer.empty()) {
+            return false;
+        }
+        pendingOps = 0;
+        return fdatasync(fd) == 0;
+    }
+
+    // Drop every record, flushed or not
+    bool truncate() {
+        buffer.clear();
+        pendingOps = 0;
+        fileBytes = 0;
+        return fd >= 0 && ftruncate(fd, 0) == 0 && fdatasync(fd) == 0;
+    }
+
+    // Read the valid prefix of a journal file; a missing file has no records.
+    // validBytes receives the length of that prefix.
+    static vector<Record> read(const string &path, uint64_t *validBytes = nullptr) {
+        vector<Record> records;
+        if (validBytes) {
+            *validBytes = 0;
+        }
+        ifstream file(path, ios::binary);
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        LIBRARY_RECORD(BytesRead, data.size());
+        const char *cursor = data.data();
+        const char *end = data.data() + data.size();
+
+        while (cursor < end) {
+            const char *start = cursor;
+            char op = *cursor++;
+            uint32_t payloadSize, sum;
+            if (!get(cursor, end, payloadSize) || static_cast<size_t>(end - cursor) < payloadSize) {
+                break;
+            }
+            const char *payload = cursor;
+            const char *payloadEnd = cursor + payloadSize;
+            cursor = payloadEnd;
+            if (!get(cursor, end, sum) || sum != checksum(start, payloadEnd - start)) {
+                break;
+            }
+
+            Record record{static_cast<Op>(op), Book()};
+            bool ok = true;
+            if (op == Remove) {
+                ok = getString(payload, payloadEnd, record.book.isbn);
+            } else if (op == Add || op == Update) {
+                int32_t year = 0;
+                ok = getString(payload, payloadEnd, record.book.title) &&
+                     getString(payload, payloadEnd, record.book.author) &&
+                     getString(payload, payloadEnd, record.book.isbn) &&
+                     get(payload, payloadEnd, year) &&
+                     get(payload, payloadEnd, record.book.price);
+                record.book.year = year;
+            } else if (op != Clear) {
+                ok = false;
+            }
+            if (!ok) {
+                break;
+            }
+            records.push_back(std::move(record));
+            if (validBytes) {
+                *validBytes = cursor - data.data();
+            }
+        }
+        return records;
+    }
+};
+
+// Heap footprint of a catalog layout
+struct MemoryUsage {
+    size_t bytes = 0;
+    size_t allocations = 0;
+    size_t unusedBytes = 0; // Part of bytes reserved ahead but not yet holding data
+};
+
+// Approximate heap held by a node-based hash table: the bucket array plus one node per entry
+template <typename Table>
+MemoryUsage hashTableUsage(const Table &table) {
+    return {table.bucket_count() * sizeof(void *) +
+                table.size() * (sizeof(typename Table::value_type) + 2 * sizeof(void *)),
+            table.size() + 1};
+}
+
+// Bump allocator for immutable strings. Strings are copied into large blocks
+// and released together when the arena is destroyed.
+class StringArena {
+private:
+    static constexpr size_t blockSize = 1 << 20;
+
+    vector<unique_ptr<char[]>> blocks;
+    size_t reserved = 0;
+    size_t stored = 0;
+    char *cursor = nullptr;
+    size_t left = 0;
+
+public:
+    StringArena() = default;
+    StringArena(StringArena &&) = default;
+    StringArena &operator=(StringArena &&) = default;
+
+    // Copy text into the arena and return a view of the copy
+    string_view store(string_view text) {
+        if (text.empty()) {
+            return string_view();
+        }
+        if (text.size() > left) {
+            size_t size = max(blockSize, text.size());
+            blocks.emplace_back(new char[size]);
+            reserved += size;
+            cursor = blocks.back().get();
+            left = size;
+        }
+        memcpy(cursor, text.data(), text.size());
+        string_view copy(cursor, text.size());
+        cursor += text.size();
+        left -= text.size();
+        stored += text.size();
+        return copy;
+    }
+
+    // Blocks are reserved whole, so a small arena is mostly unused bytes
+    MemoryUsage memoryUsage() const {
+        return {reserved + blocks.capacity() * sizeof(blocks[0]), blocks.size() + (blocks.capacity() ? 1 : 0),
+                reserved - stored};
+    }
+};
+
+// Read-mostly catalog whose string fields live in a per-catalog arena.
+// Titles and ISBNs are bump-allocated and authors are interned, so an author
+// with hundreds of books is stored once. Records hold views and small ids
+// instead of three std::strings each.
+class CompactCatalog {
+private:
+    struct Record {
+        string_view title;
+        string_view isbn;
+        uint32_t author;
+        int32_t year;
+        double price;
+    };
+
+    StringArena arena;
+    vector<Record> records;
+    vector<string_view> authors;                     // author id -> name
+    unordered_map<string_view, uint32_t> authorIds;  // name -> author id
+    unordered_map<string_view, uint32_t> isbnIndex;  // ISBN -> record
+
+public:
+    // Add a record; returns false if the ISBN is already present
+    bool add(string_view title, string_view author, string_view isbn, int year, double price) {
+        if (isbnIndex.count(isbn) != 0) {
+            return false;
+        }
+        auto known = authorIds.find(author);
+        uint32_t authorId;
+        if (known != authorIds.end()) {
+            authorId = known->second;
+        } else {
+            authorId = static_cast<uint32_t>(authors.size());
+            authors.push_back(arena.store(author));
+            authorIds.emplace(authors.back(), authorId);
+        }
+        Record record{arena.store(title), arena.store(isbn), authorId, year, price};
+        isbnIndex.emplace(record.isbn, static_cast<uint32_t>(records.size()));
+        records.push_back(record);
+        return true;
+    }
+
+    bool add(const Book &book) {
+        return add(book.title, book.author, book.isbn, book.year, book.price);
+    }
+
+    // Load a text catalog straight into the arena, without building Books
+    LoadReport loadFromFile(const string &filename) {
+        LoadReport report;
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            return report;
+        }
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        parseCatalogRecords(data.data(), data.data() + data.size(), 1, report.errors,
+                            [&](string_view title, string_view author, string_view isbn, int year,
+                                double price, size_t line) {
+            if (add(title, author, isbn, year, price)) {
+                ++report.loaded;
+            } else {
+                report.errors.push_back({line, "duplicate ISBN '" + string(isbn) + "'"});
+            }
+        });
+        return report;
+    }
+
+    size_t size() const {
+        return records.size();
+    }
+
+    size_t authorCount() const {
+        return authors.size();
+    }
+
+    string_view title(size_t i) const {
+        return records[i].title;
+    }
+
+    string_view author(size_t i) const {
+        return authors[records[i].author];
+    }
+
+    string_view isbn(size_t i) const {
+        return records[i].isbn;
+    }
+
+    int year(size_t i) const {
+        return records[i].year;
+    }
+
+    double price(size_t i) const {
+        return records[i].price;
+    }
+
+    Book bookAt(size_t i) const {
+        return Book(string(title(i)), string(author(i)), string(isbn(i)), year(i), price(i));
+    }
+
+    // Position of the record with the given ISBN, or -1 if absent
+    size_t findByISBN(string_view isbn) const {
+        auto it = isbnIndex.find(isbn);
+        return it == isbnIndex.end() ? static_cast<size_t>(-1) : it->second;
+    }
+
+    // Positions of the records whose title contains the query
+    vector<size_t> findByTitle(string_view query) const {
+        vector<size_t> positions;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (records[i].title.find(query) != string_view::npos) {
+                positions.push_back(i);
+            }
+        }
+        return positions;
+    }
+
+    // Positions of the records whose author contains the query; each distinct
+    // author is tested once
+    vector<size_t> findByAuthor(string_view query) const {
+        vector<bool> matches(authors.size());
+        for (size_t a = 0; a < authors.size(); ++a) {
+            matches[a] = authors[a].find(query) != string_view::npos;
+        }
+        vector<size_t> positions;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (matches[records[i].author]) {
+                positions.push_back(i);
+            }
+        }
+        return positions;
+    }
+
+    // Heap bytes and allocations held by the records, the arena and the lookup tables
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage = arena.memoryUsage();
+        for (MemoryUsage part : {hashTableUsage(authorIds), hashTableUsage(isbnIndex)}) {
+            usage.bytes += part.bytes;
+            usage.allocations += part.allocations;
+        }
+        usage.bytes += records.capacity() * sizeof(Record) + authors.capacity() * sizeof(string_view);
+        usage.allocations += 2;
+        return usage;
+    }
+};
+
+// Range filters over numeric columns. Each kernel sets bit i of mask (64 bits
+// per word) when lo <= values[i] <= hi; mask must hold (n + 63) / 64 zeroed
+// words. rangeMask picks AVX2 or SSE2 at run time and falls back to scalar code.
+template <typename T>
+void rangeMaskScalar(const T *values, size_t from, size_t n, T lo, T hi, uint64_t *mask) {
+    for (size_t i = from; i < n; ++i) {
+        if (lo <= values[i] && values[i] <= hi) {
+            mask[i >> 6] |= static_cast<uint64_t>(1) << (i & 63);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void rangeMaskAvx2(const double *values, size_t n, double lo, double hi, uint64_t *mask) {
+    __m256d low = _mm256_set1_pd(lo);
+    __m256d high = _mm256_set1_pd(hi);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(v, low, _CMP_GE_OQ), _mm256_cmp_pd(v, high, _CMP_LE_OQ));
+        mask[i >> 6] |= static_cast<uint64_t>(_mm256_movemask_pd(in)) << (i & 63);
+    }
+    rangeMaskScalar(values, i, n, lo, hi, mask);
+}
+
+__attribute__((target("avx2")))
+void rangeMaskAvx2(const int *values, size_t n, int lo, int hi, uint64_t *mask) {
+    __m256i low = _mm256_set1_epi32(lo);
+    __m256i high = _mm256_set1_epi32(hi);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(low, v), _mm256_cmpgt_epi32(v, high));
+        unsigned bits = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(out))) & 0xFF;
+        mask[i >> 6] |= static_cast<uint64_t>(bits) << (i & 63);
+    }
+    rangeMaskScalar(values, i, n, lo, hi, mask);
+}
+#endif
+
+#if defined(__SSE2__)
+void rangeMaskSse2(const double *values, size_t n, double lo, double hi, uint64_t *mask) {
+    __m128d low = _mm_set1_pd(lo);
+    __m128d high = _mm_set1_pd(hi);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        __m128d in = _mm_and_pd(_mm_cmpge_pd(v, low), _mm_cmple_pd(v, high));
+        mask[i >> 6] |= static_cast<uint64_t>(_mm_movemask_pd(in)) << (i & 63);
+    }
+    rangeMaskScalar(values, i, n, lo, hi, mask);
+}
+
+void rangeMaskSse2(const int *values, size_t n, int lo, int hi, uint64_t *mask) {
+    __m128i low = _mm_set1_epi32(lo);
+    __m128i high = _mm_set1_epi32(hi);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i));
+        __m128i out = _mm_or_si128(_mm_cmpgt_epi32(low, v), _mm_cmpgt_epi32(v, high));
+        unsigned bits = ~static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(out))) & 0xF;
+        mask[i >> 6] |= static_cast<uint64_t>(bits) << (i & 63);
+    }
+    rangeMaskScalar(values, i, n, lo, hi, mask);
+}
+#endif
+
+template <typename T>
+void rangeMask(const T *values, size_t n, T lo, T hi, uint64_t *mask) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        rangeMaskAvx2(values, n, lo, hi, mask);
+        return;
+    }
+#endif
+#if defined(__SSE2__)
+    rangeMaskSse2(values, n, lo, hi, mask);
+#else
+    rangeMaskScalar(values, 0, n, lo, hi, mask);
+#endif
+}
+
+// Indexes of the set bits of a mask, ascending
+vector<size_t> maskPositions(const vector<uint64_t> &mask) {
+    vector<size_t> positions;
+    for (size_t w = 0; w < mask.size(); ++w) {
+        for (uint64_t bits = mask[w]; bits != 0; bits &= bits - 1) {
+            positions.push_back(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+    return positions;
+}
+
+// Owning pointer to a Library's journal. A copied Library starts without a
+// journal, so two libraries never append to the same file.
+class JournalPtr : public unique_ptr<Journal> {
+public:
+    JournalPtr() = default;
+    JournalPtr(const JournalPtr &) : unique_ptr<Journal>() {}
+    JournalPtr(JournalPtr &&) = default;
+    JournalPtr &operator=(JournalPtr &&) = default;
+    using unique_ptr<Journal>::operator=;
+
+    JournalPtr &operator=(const JournalPtr &) {
+        reset();
+        return *this;
+    }
+};
+
+// Trigram inverted index used to narrow substring searches.
+// Maps every 3-byte substring of the indexed text to the sorted ids containing it.
+class TrigramIndex {
+private:
+    unordered_map<uint32_t, vector<uint32_t>> postings;
+    bool foldCase;
+
+    uint32_t byteAt(const string &text, size_t i) const {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        return foldCase ? static_cast<uint32_t>(tolower(c)) : c;
+    }
+
+    uint32_t gramAt(const string &text, size_t i) const {
+        return (byteAt(text, i) << 16) | (byteAt(text, i + 1) << 8) | byteAt(text, i + 2);
+    }
+
+    // Distinct trigrams of a string
+    vector<uint32_t> gramsOf(const string &text) const {
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= text.size(); ++i) {
+            grams.push_back(gramAt(text, i));
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+public:
+    // A case-folded index treats ASCII letters as lower case in texts and queries
+    explicit TrigramIndex(bool foldCase = false) : foldCase(foldCase) {}
+
+    void add(uint32_t id, const string &text) {
+        for (uint32_t gram : gramsOf(text)) {
+            vector<uint32_t> &ids = postings[gram];
+            if (ids.empty() || ids.back() < id) {
+                ids.push_back(id);
+            } else {
+                ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+            }
+        }
+    }
+
+    void remove(uint32_t id, const string &text) {
+        for (uint32_t gram : gramsOf(text)) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) {
+                continue;
+            }
+            vector<uint32_t> &ids = it->second;
+            auto pos = lower_bound(ids.begin(), ids.end(), id);
+            if (pos != ids.end() && *pos == id) {
+                ids.erase(pos);
+            }
+            if (ids.empty()) {
+                postings.erase(it);
+            }
+        }
+    }
+
+    void clear() {
+        postings.clear();
+    }
+
+    // Collect the sorted ids whose text contains every trigram of the query.
+    // Returns false if the query is shorter than a trigram and cannot be narrowed.
+    bool candidates(const string &query, vector<uint32_t> &out) const {
+        out.clear();
+        if (query.size() < 3) {
+            return false;
+        }
+
+        vector<const vector<uint32_t> *> lists;
+        for (uint32_t gram : gramsOf(query)) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) {
+                return true; // Some trigram never occurs, so nothing can match
+            }
+            lists.push_back(&it->second);
+        }
+
+        // Intersect starting from the shortest posting list
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t> *a, const vector<uint32_t> *b) {
+            return a->size() < b->size();
+        });
+        out = *lists[0];
+        for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+            vector<uint32_t> next;
+            set_intersection(out.begin(), out.end(), lists[i]->begin(), lists[i]->end(),
+                             back_inserter(next));
+            out.swap(next);
+        }
+        return true;
+    }
+
+    // Collect the sorted ids (all below idLimit) whose text shares at least
+    // minShared distinct trigrams with the query
+    void sharedCandidates(const string &query, size_t minShared, size_t idLimit, vector<uint32_t> &out) const {
+        out.clear();
+        vector<uint16_t> shared(idLimit);
+        for (uint32_t gram : gramsOf(query)) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) {
+                continue;
+            }
+            for (uint32_t id : it->second) {
+                if (++shared[id] == minShared) {
+                    out.push_back(id);
+                }
+            }
+        }
+        sort(out.begin(), out.end());
+    }
+
+    // Number of distinct trigrams in a query
+    size_t gramCount(const string &query) const {
+        return gramsOf(query).size();
+    }
+};
+
+// Myers' bit-parallel approximate matcher: the fewest edits (insertions,
+// deletions, substitutions) needed to turn the pattern into some substring
+// of a text, ignoring ASCII case. Patterns longer than 64 bytes fall back to
+// the O(m*n) dynamic programme.
+class FuzzyPattern {
+private:
+    string pattern;
+    uint64_t peq[256] = {}; // Bit i set where pattern[i] equals the byte
+
+    static unsigned char fold(char c) {
+        return static_cast<unsigned char>(tolower(static_cast<unsigned char>(c)));
+    }
+
+    size_t dynamicDistance(string_view text) const {
+        // column[i]: edits to match pattern[0..i) ending at the current text byte
+        vector<size_t> column(pattern.size() + 1);
+        for (size_t i = 0; i <= pattern.size(); ++i) {
+            column[i] = i;
+        }
+        size_t best = column.back();
+        for (char c : text) {
+            size_t diagonal = 0; // Empty pattern prefix matches anywhere for free
+            for (size_t i = 1; i <= pattern.size(); ++i) {
+                size_t above = column[i];
+                size_t cost = static_cast<unsigned char>(pattern[i - 1]) == fold(c) ? 0 : 1;
+                column[i] = min({diagonal + cost, above + 1, column[i - 1] + 1});
+                diagonal = above;
+            }
+            best = min(best, column.back());
+        }
+        return best;
+    }
+
+public:
+    explicit FuzzyPattern(const string &text) {
+        pattern.reserve(text.size());
+        for (char c : text) {
+            pattern += static_cast<char>(fold(c));
+        }
+        for (size_t i = 0; i < pattern.size() && i < 64; ++i) {
+            peq[static_cast<unsigned char>(pattern[i])] |= uint64_t(1) << i;
+        }
+        // Both cases of a letter match; fold texts byte by byte via peq
+        for (int c = 'A'; c <= 'Z'; ++c) {
+            peq[c] = peq[tolower(c)];
+        }
+    }
+
+    size_t size() const {
+        return pattern.size();
+    }
+
+    // Fewest edits between the pattern and any substring of text
+    size_t distance(string_view text) const {
+        size_t m = pattern.size();
+        if (m == 0) {
+            return 0;
+        }
+        if (m > 64) {
+            return dynamicDistance(text);
+        }
+        uint64_t pv = ~uint64_t(0), mv = 0;
+        uint64_t last = uint64_t(1) << (m - 1);
+        size_t score = m, best = m;
+        for (char c : text) {
+            uint64_t eq = peq[static_cast<unsigned char>(c)];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            score += (ph & last) ? 1 : 0;
+            score -= (mh & last) ? 1 : 0;
+            // No carry into bit 0: a match may start anywhere in the text
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            best = min(best, score);
+        }
+        return best;
+    }
+};
+
+// A distinct field value offered by autocomplete and the number of books with it
+struct Completion {
+    string text;
+    size_t count;
+};
+
+// Autocomplete over the distinct values of one field. Every value is entered
+// once per word start ("The C++ Primer" under "the c++ primer", "c++ primer"
+// and "primer"), case-folded, in a sorted array of (value, offset) entries
+// found by binary search. A max-tree over the entries' book counts yields the
+// top completions of any prefix range best-first, so a query costs about
+// n log(entries) however many values match. New entries wait in a small
+// sorted buffer that is merged into the array in one pass once it fills;
+// values whose count drops to zero linger until the table is compacted.
+class PrefixIndex {
+private:
+    struct Entry {
+        uint32_t value;
+        uint32_t offset;
+    };
+
+    static constexpr size_t pendingLimit = 4096;
+
+    vector<string> values;  // Original text
+    vector<string> folded;  // Lower-cased text, compared by the entries
+    vector<size_t> counts;  // Books holding each value
+    unordered_map<string, uint32_t> valueIds;
+    size_t deadValues = 0;  // Values whose count is zero
+    vector<Entry> entries;  // Sorted by (key, value)
+    vector<Entry> pending;  // Sorted by (key, value), merged into entries when full
+    vector<uint32_t> best;  // Tree over entries: node -> best entry index below it
+
+    string_view key(const Entry &entry) const {
+        return string_view(folded[entry.value]).substr(entry.offset);
+    }
+
+    bool less(const Entry &a, const Entry &b) const {
+        int order = key(a).compare(key(b));
+        return order != 0 ? order < 0 : a.value < b.value;
+    }
+
+    auto byKey() const {
+        return [this](const Entry &a, const Entry &b) { return less(a, b); };
+    }
+
+    // Entry a ranks before entry b: more books, then earlier in key order
+    bool better(uint32_t a, uint32_t b) const {
+        size_t countA = counts[entries[a].value], countB = counts[entries[b].value];
+        return countA != countB ? countA > countB : a < b;
+    }
+
+    static string foldCase(const string &text) {
+        string result(text);
+        for (char &c : result) {
+            c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+        return result;
+    }
+
+    void appendEntries(uint32_t value, vector<Entry> &out) const {
+        const string &text = folded[value];
+        for (size_t i = 0; i < text.size(); ++i) {
+            bool wordStart = isalnum(static_cast<unsigned char>(text[i])) &&
+                             (i == 0 || !isalnum(static_cast<unsigned char>(text[i - 1])));
+            if (wordStart) {
+                out.push_back({value, static_cast<uint32_t>(i)});
+            }
+        }
+    }
+
+    uint32_t intern(const string &text, bool &created) {
+        auto inserted = valueIds.emplace(text, static_cast<uint32_t>(values.size()));
+        created = inserted.second;
+        if (created) {
+            values.push_back(text);
+            folded.push_back(foldCase(text));
+            counts.push_back(0);
+        }
+        return inserted.first->second;
+    }
+
+    void fixParents(size_t node) {
+        for (node /= 2; node >= 1; node /= 2) {
+            uint32_t left = best[2 * node], right = best[2 * node + 1];
+            best[node] = better(left, right) ? left : right;
+        }
+    }
+
+    void rebuildTree() {
+        size_t n = entries.size();
+        best.assign(2 * n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            best[n + i] = static_cast<uint32_t>(i);
+        }
+        for (size_t node = n - 1; node >= 1 && node < n; --node) {
+            uint32_t left = best[2 * node], right = best[2 * node + 1];
+            best[node] = better(left, right) ? left : right;
+        }
+    }
+
+    // Re-rank a value's entries in the tree after its count changed
+    void countChanged(uint32_t value) {
+        vector<Entry> own;
+        appendEntries(value, own);
+        for (const Entry &entry : own) {
+            auto it = lower_bound(entries.begin(), entries.end(), entry, byKey());
+            if (it != entries.end() && it->value == value && it->offset == entry.offset) {
+                fixParents(entries.size() + (it - entries.begin()));
+            }
+        }
+    }
+
+    // [first, last) of the entries in list whose key starts with prefix
+    pair<size_t, size_t> prefixRange(const vector<Entry> &list, string_view prefix) const {
+        auto first = lower_bound(list.begin(), list.end(), prefix, [this](const Entry &entry, string_view p) {
+            return key(entry) < p;
+        });
+        auto last = upper_bound(first, list.end(), prefix, [this](string_view p, const Entry &entry) {
+            return p < key(entry).substr(0, p.size());
+        });
+        return {static_cast<size_t>(first - list.begin()), static_cast<size_t>(last - list.begin())};
+    }
+
+    // Sort a bulk batch of entries. Each key's first eight bytes are packed
+    // into one integer, which settles most comparisons without touching the
+    // strings; ties fall back to the rest of the key, then the value.
+    void sortEntries(vector<Entry> &list) const {
+        struct Keyed {
+            uint64_t head;
+            string_view text;
+            Entry entry;
+        };
+        vector<Keyed> keyed;
+        keyed.reserve(list.size());
+        for (const Entry &entry : list) {
+            string_view text = key(entry);
+            uint64_t head = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                head = (head << 8) | (i < text.size() ? static_cast<unsigned char>(text[i]) : 0);
+            }
+            keyed.push_back({head, text, entry});
+        }
+        sort(keyed.begin(), keyed.end(), [](const Keyed &a, const Keyed &b) {
+            if (a.head != b.head) {
+                return a.head < b.head;
+            }
+            int order = a.text.compare(b.text);
+            return order != 0 ? order < 0 : a.entry.value < b.entry.value;
+        });
+        for (size_t i = 0; i < list.size(); ++i) {
+            list[i] = keyed[i].entry;
+        }
+    }
+
+    void mergePending() {
+        size_t middle = entries.size();
+        entries.insert(entries.end(), pending.begin(), pending.end());
+        inplace_merge(entries.begin(), entries.begin() + middle, entries.end(), byKey());
+        pending.clear();
+        rebuildTree();
+    }
+
+    // Rebuild the value table and entries from the live values only
+    void compact() {
+        vector<string> liveValues;
+        vector<size_t> liveCounts;
+        for (size_t v = 0; v < values.size(); ++v) {
+            if (counts[v] > 0) {
+                liveValues.push_back(std::move(values[v]));
+                liveCounts.push_back(counts[v]);
+            }
+        }
+        clear();
+        for (size_t v = 0; v < liveValues.size(); ++v) {
+            bool created;
+            uint32_t id = intern(liveValues[v], created);
+            counts[id] = liveCounts[v];
+            appendEntries(id, entries);
+        }
+        sortEntries(entries);
+        rebuildTree();
+    }
+
+public:
+    void add(const string &text) {
+        bool created;
+        uint32_t id = intern(text, created);
+        if (counts[id]++ == 0 && !created) {
+            --deadValues;
+        }
+        if (!created) {
+            countChanged(id);
+            return;
+        }
+        vector<Entry> fresh;
+        appendEntries(id, fresh);
+        for (const Entry &entry : fresh) {
+            pending.insert(upper_bound(pending.begin(), pending.end(), entry, byKey()), entry);
+        }
+        if (pending.size() >= pendingLimit) {
+            mergePending();
+        }
+    }
+
+    void remove(const string &text) {
+        auto it = valueIds.find(text);
+        if (it == valueIds.end() || counts[it->second] == 0) {
+            return;
+        }
+        uint32_t id = it->second;
+        if (--counts[id] == 0 && ++deadValues > valueIds.size() / 2) {
+            compact();
+        } else {
+            countChanged(id);
+        }
+    }
+
+    // Index many values at once with a single sort
+    void addAll(const vector<const string *> &texts) {
+        for (const string *text : texts) {
+            bool created;
+            uint32_t id = intern(*text, created);
+            if (created) {
+                appendEntries(id, pending);
+            } else if (counts[id] == 0) {
+                --deadValues;
+            }
+            ++counts[id];
+        }
+        sortEntries(pending);
+        mergePending();
+    }
+
+    void clear() {
+        values.clear();
+        folded.clear();
+        counts.clear();
+        valueIds.clear();
+        entries.clear();
+        pending.clear();
+        best.clear();
+        deadValues = 0;
+    }
+
+    // The n values with the most books among those having a word that starts
+    // with prefix (ignoring case); ties go to the alphabetically first
+    // matching word
+    vector<Completion> complete(const string &prefix, size_t n) const {
+        string wanted = foldCase(prefix);
+        size_t size = entries.size();
+
+        // Best-first walk of the tree nodes covering the matching entries
+        auto worse = [this](uint32_t a, uint32_t b) { return better(best[b], best[a]); };
+        priority_queue<uint32_t, vector<uint32_t>, decltype(worse)> frontier(worse);
+        pair<size_t, size_t> range = prefixRange(entries, wanted);
+        for (size_t lo = range.first + size, hi = range.second + size; lo < hi; lo /= 2, hi /= 2) {
+            if (lo & 1) {
+                frontier.push(static_cast<uint32_t>(lo++));
+            }
+            if (hi & 1) {
+                frontier.push(static_cast<uint32_t>(--hi));
+            }
+        }
+
+        // Buffered entries are few; rank them directly
+        vector<Entry> buffered;
+        pair<size_t, size_t> pendingRange = prefixRange(pending, wanted);
+        for (size_t i = pendingRange.first; i < pendingRange.second; ++i) {
+            buffered.push_back(pending[i]);
+        }
+        stable_sort(buffered.begin(), buffered.end(), [this](const Entry &a, const Entry &b) {
+            return counts[a.value] > counts[b.value];
+        });
+
+        vector<Completion> result;
+        unordered_set<uint32_t> seen;
+        size_t next = 0;
+        while (result.size() < n) {
+            while (!frontier.empty() && frontier.top() < size) {
+                uint32_t node = frontier.top();
+                frontier.pop();
+                frontier.push(2 * node);
+                frontier.push(2 * node + 1);
+            }
+            bool haveTree = !frontier.empty() && counts[entries[frontier.top() - size].value] > 0;
+            bool haveBuffered = next < buffered.size() && counts[buffered[next].value] > 0;
+            if (!haveTree && !haveBuffered) {
+                break;
+            }
+            Entry entry;
+            if (haveTree && haveBuffered) {
+                const Entry &fromTree = entries[frontier.top() - size];
+                size_t treeCount = counts[fromTree.value], bufferedCount = counts[buffered[next].value];
+                haveTree = treeCount != bufferedCount ? treeCount > bufferedCount : less(fromTree, buffered[next]);
+            }
+            if (haveTree) {
+                entry = entries[frontier.top() - size];
+                frontier.pop();
+            } else {
+                entry = buffered[next++];
+            }
+            if (seen.insert(entry.value).second) {
+                result.push_back({values[entry.value], counts[entry.value]});
+            }
+        }
+        return result;
+    }
+};
+
+// Read-only view of a binary catalog file mapped with mmap.
+//
+// Layout (native byte order, version 1):
+//   Header   64 bytes, see BinaryCatalog::Header
+//   years    int32_t[count]
+//   prices   double[count]            (8-byte aligned)
+//   offsets  uint64_t[3 * count + 1]  title/author/isbn of record i start at
+//                                     offsets[3i], offsets[3i+1], offsets[3i+2]
+//   heap     string bytes, no terminators
+//
+// Fields are read straight out of the mapping, so a query only touches the
+// columns it needs and only materializes a Book for the records it returns.
+class BinaryCatalog {
+public:
+    static constexpr uint32_t version = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t yearsOffset;
+        uint64_t pricesOffset;
+        uint64_t stringOffsetsOffset;
+        uint64_t heapOffset;
+        uint64_t heapSize;
+    };
+    static_assert(sizeof(Header) == 64, "binary catalog header must stay 64 bytes");
+
+private:
+    static constexpr char magicBytes[8] = {'L', 'I', 'B', 'C', 'A', 'T', '\0', '\0'};
+
+    const char *data = nullptr;
+    size_t length = 0;
+    size_t count = 0;
+    const int32_t *years = nullptr;
+    const double *prices = nullptr;
+    const uint64_t *stringOffsets = nullptr;
+    const char *heap = nullptr;
+    uint64_t heapSize = 0;
+
+    static uint64_t alignTo8(uint64_t n) {
+        return (n + 7) & ~static_cast<uint64_t>(7);
+    }
+
+    // True if items elements of itemSize bytes starting at offset lie inside
+    // the mapping and offset is aligned for them; written so no sum can overflow
+    bool fits(uint64_t offset, uint64_t items, uint64_t itemSize) const {
+        return offset <= length && offset % itemSize == 0 && items <= (length - offset) / itemSize;
+    }
+
+    string_view field(size_t i, size_t which) const {
+        uint64_t begin = stringOffsets[3 * i + which];
+        uint64_t end = stringOffsets[3 * i + which + 1];
+        if (begin > end || end > heapSize) {
+            return string_view(); // Corrupt entry; never read outside the heap
+        }
+        return string_view(heap + begin, end - begin);
+    }
+
+    template <typename Match>
+    vector<Book> collect(Match match) const {
+        vector<Book> result;
+        for (size_t i = 0; i < count; ++i) {
+            if (match(i)) {
+                result.push_back(bookAt(i));
+            }
+        }
+        return result;
+    }
+
+public:
+    BinaryCatalog() = default;
+    BinaryCatalog(const BinaryCatalog &) = delete;
+    BinaryCatalog &operator=(const BinaryCatalog &) = delete;
+
+    BinaryCatalog(BinaryCatalog &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    BinaryCatalog &operator=(BinaryCatalog &&other) noexcept {
+        if (this != &other) {
+            close();
+            data = other.data;
+            length = other.length;
+            count = other.count;
+            years = other.years;
+            prices = other.prices;
+            stringOffsets = other.stringOffsets;
+            heap = other.heap;
+            heapSize = other.heapSize;
+            other.data = nullptr;
+            other.length = 0;
+            other.count = 0;
+        }
+        return *this;
+    }
+
+    ~BinaryCatalog() {
+        close();
+    }
+
+    // Map a catalog file; returns false if it is missing or not a valid version 1 catalog
+    bool open(const string &filename) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char *>(mapped);
+        length = st.st_size;
+
+        Header header;
+        memcpy(&header, data, sizeof(header));
+        uint64_t n = header.count;
+        bool valid = memcmp(header.magic, magicBytes, sizeof(magicBytes)) == 0 &&
+                     header.version == version &&
+                     n <= length / sizeof(uint64_t) &&
+                     fits(header.yearsOffset, n, sizeof(int32_t)) &&
+                     fits(header.pricesOffset, n, sizeof(double)) &&
+                     fits(header.stringOffsetsOffset, 3 * n + 1, sizeof(uint64_t)) &&
+                     header.heapOffset <= length && header.heapSize <= length - header.heapOffset;
+        if (!valid) {
+            close();
+            return false;
+        }
+
+        LIBRARY_RECORD(BytesRead, length);
+        count = n;
+        years = reinterpret_cast<const int32_t *>(data + header.yearsOffset);
+        prices = reinterpret_cast<const double *>(data + header.pricesOffset);
+        stringOffsets = reinterpret_cast<const uint64_t *>(data + header.stringOffsetsOffset);
+        heap = data + header.heapOffset;
+        heapSize = header.heapSize;
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) {
+            munmap(const_cast<char *>(data), length);
+        }
+        data = nullptr;
+        length = 0;
+        count = 0;
+    }
+
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    string_view title(size_t i) const {
+        return field(i, 0);
+    }
+
+    string_view author(size_t i) const {
+        return field(i, 1);
+    }
+
+    string_view isbn(size_t i) const {
+        return field(i, 2);
+    }
+
+    int year(size_t i) const {
+        return years[i];
+    }
+
+    double price(size_t i) const {
+        return prices[i];
+    }
+
+    // Materialize record i as a Book
+    Book bookAt(size_t i) const {
+        return Book(string(title(i)), string(author(i)), string(isbn(i)), year(i), price(i));
+    }
+
+    // Search books by title without deserializing non-matching records
+    vector<Book> searchByTitle(const string &query) const {
+        return collect([&](size_t i) { return title(i).find(query) != string_view::npos; });
+    }
+
+    // Search books by author without deserializing non-matching records
+    vector<Book> searchByAuthor(const string &query) const {
+        return collect([&](size_t i) { return author(i).find(query) != string_view::npos; });
+    }
+
+    // Find a book by ISBN. The file has no ISBN index, so this is a linear
+    // O(n) scan of the ISBN strings; load the catalog into a Library when
+    // lookups are frequent.
+    std::optional<Book> findByISBN(const string &query) const {
+        for (size_t i = 0; i < count; ++i) {
+            if (isbn(i) == query) {
+                return bookAt(i);
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Write books as a version 1 binary catalog
+    static bool write(const string &filename, const vector<Book> &books) {
+        ofstream file(filename, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            return false;
+        }
+
+        uint64_t n = books.size();
+        Header header = {};
+        memcpy(header.magic, magicBytes, sizeof(magicBytes));
+        header.version = version;
+        header.count = n;
+        header.yearsOffset = sizeof(Header);
+        header.pricesOffset = alignTo8(header.yearsOffset + n * sizeof(int32_t));
+        header.stringOffsetsOffset = header.pricesOffset + n * sizeof(double);
+        header.heapOffset = header.stringOffsetsOffset + (3 * n + 1) * sizeof(uint64_t);
+
+        vector<int32_t> yearColumn;
+        vector<double> priceColumn;
+        vector<uint64_t> offsets;
+        yearColumn.reserve(n);
+        priceColumn.reserve(n);
+        offsets.reserve(3 * n + 1);
+        uint64_t heapBytes = 0;
+        for (const auto &book : books) {
+            yearColumn.push_back(book.year);
+            priceColumn.push_back(book.price);
+            for (const string *text : {&book.title, &book.author, &book.isbn}) {
+                offsets.push_back(heapBytes);
+                heapBytes += text->size();
+            }
+        }
+        offsets.push_back(heapBytes);
+        header.heapSize = heapBytes;
+
+        static const char padding[8] = {};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(yearColumn.data()), n * sizeof(int32_t));
+        file.write(padding, header.pricesOffset - (header.yearsOffset + n * sizeof(int32_t)));
+        file.write(reinterpret_cast<const char *>(priceColumn.data()), n * sizeof(double));
+        file.write(reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        for (const auto &book : books) {
+            file << book.title << book.author << book.isbn;
+        }
+        LIBRARY_RECORD(BytesWritten, static_cast<uint64_t>(file.tellp()));
+        file.close();
+        return !file.fail();
+    }
+};
+
+// Books ordered by one field. Entries are (key, id) pairs, so equal keys keep
+// insertion order and positions in the catalog can shift without touching the index.
+template <typename Key>
+class OrderedIndex {
+private:
+    set<pair<Key, uint32_t>> entries;
+
+public:
+    using const_iterator = typename set<pair<Key, uint32_t>>::const_iterator;
+    using const_reverse_iterator = typename set<pair<Key, uint32_t>>::const_reverse_iterator;
+
+    void add(const Key &key, uint32_t id) {
+        entries.emplace(key, id);
+    }
+
+    void remove(const Key &key, uint32_t id) {
+        entries.erase(make_pair(key, id));
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    const_iterator begin() const {
+        return entries.begin();
+    }
+
+    const_iterator end() const {
+        return entries.end();
+    }
+
+    const_reverse_iterator rbegin() const {
+        return entries.rbegin();
+    }
+
+    const_reverse_iterator rend() const {
+        return entries.rend();
+    }
+
+    // First entry with key >= lo
+    const_iterator lowerBound(const Key &lo) const {
+        return entries.lower_bound(make_pair(lo, static_cast<uint32_t>(0)));
+    }
+
+    // First entry with key > hi
+    const_iterator upperBound(const Key &hi) const {
+        return entries.upper_bound(make_pair(hi, numeric_limits<uint32_t>::max()));
+    }
+};
+
+// Fields a catalog can be ordered by
+enum class SortKey { Price, Year, Title, Author };
+
+// How sortByPrice and sortByYear compute the order; every choice is stable.
+// Auto picks comparison sorting for tiny catalogs and radix sorting (parallel
+// when more than one thread is available) otherwise.
+enum class SortAlgorithm { Auto, Comparison, Radix, ParallelRadix };
+
+// Unsigned key that orders like the price: -0.0 sorts with 0.0 and NaN last
+inline uint64_t sortablePriceKey(double price) {
+    if (price == 0) {
+        price = 0;
+    } else if (price != price) {
+        return numeric_limits<uint64_t>::max();
+    }
+    uint64_t bits;
+    memcpy(&bits, &price, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+// Unsigned key that orders like the year
+inline uint32_t sortableYearKey(int year) {
+    return static_cast<uint32_t>(year) ^ (1U << 31);
+}
+
+// Run work(chunk) for chunk in [0, chunks), on the pool when one is given
+template <typename Work>
+void runChunks(size_t chunks, ThreadPool *pool, Work work) {
+    if (pool == nullptr || chunks <= 1) {
+        for (size_t c = 0; c < chunks; ++c) {
+            work(c);
+        }
+        return;
+    }
+    vector<future<void>> pending;
+    for (size_t c = 0; c < chunks; ++c) {
+        pending.push_back(pool->submit([&work, c] { work(c); }));
+    }
+    for (auto &done : pending) {
+        done.get();
+    }
+}
+
+// A sort key and the position it came from
+template <typename Key>
+struct SortItem {
+    Key key;
+    uint32_t index;
+};
+
+// One stable counting-sort pass from in to out by digit(item) < buckets.
+// With a pool, contiguous chunks are histogrammed and scattered in parallel;
+// per-chunk bucket offsets keep equal digits in input order.
+template <typename Item, typename Digit>
+void countingPass(const vector<Item> &in, vector<Item> &out, size_t buckets, Digit digit, ThreadPool *pool) {
+    size_t chunks = pool == nullptr ? 1 : max<size_t>(1, min(pool->size(), in.size() / 65536));
+    vector<vector<size_t>> offsets(chunks, vector<size_t>(buckets));
+    auto begin = [&](size_t c) { return in.size() * c / chunks; };
+
+    runChunks(chunks, pool, [&](size_t c) {
+        vector<size_t> &count = offsets[c];
+        for (size_t i = begin(c), end = begin(c + 1); i < end; ++i) {
+            ++count[digit(in[i])];
+        }
+    });
+    size_t offset = 0;
+    for (size_t d = 0; d < buckets; ++d) {
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t count = offsets[c][d];
+            offsets[c][d] = offset;
+            offset += count;
+        }
+    }
+    runChunks(chunks, pool, [&](size_t c) {
+        vector<size_t> &next = offsets[c];
+        for (size_t i = begin(c), end = begin(c + 1); i < end; ++i) {
+            out[next[digit(in[i])]++] = in[i];
+        }
+    });
+}
+
+// Stable permutation ordering items by key: a single counting pass when the
+// keys span at most 2^16 values, otherwise LSD radix on bytes, skipping
+// bytes that are equal in every key
+template <typename Key>
+vector<uint32_t> radixOrder(vector<SortItem<Key>> items, ThreadPool *pool) {
+    vector<uint32_t> order(items.size());
+    if (items.empty()) {
+        return order;
+    }
+    Key lo = items[0].key, hi = items[0].key, anyBits = 0, allBits = ~Key(0);
+    for (const auto &item : items) {
+        lo = min(lo, item.key);
+        hi = max(hi, item.key);
+        anyBits |= item.key;
+        allBits &= item.key;
+    }
+
+    vector<SortItem<Key>> scratch(items.size());
+    if (hi - lo < (1U << 16)) {
+        countingPass(items, scratch, static_cast<size_t>(hi - lo) + 1,
+                     [lo](const SortItem<Key> &item) { return static_cast<size_t>(item.key - lo); }, pool);
+        items.swap(scratch);
+    } else {
+        Key varying = anyBits ^ allBits;
+        for (unsigned shift = 0; shift < 8 * sizeof(Key); shift += 8) {
+            if (((varying >> shift) & 0xFF) == 0) {
+                continue;
+            }
+            countingPass(items, scratch, 256,
+                         [shift](const SortItem<Key> &item) { return static_cast<size_t>((item.key >> shift) & 0xFF); },
+                         pool);
+            items.swap(scratch);
+        }
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        order[i] = items[i].index;
+    }
+    return order;
+}
+
+// Per-item outcome of a batch operation
+enum class ItemStatus { Ok, DuplicateISBN, NotFound };
+
+// A fuzzy search hit: the book's position and the edits needed to match
+struct FuzzyMatch {
+    size_t position;
+    size_t distance;
+};
+
+// A composable filter over books, built from field predicates joined with
+// && and ||, plus optional ordering and a result limit, e.g.
+//   (Query::author("Meyers") && Query::yearBetween(2011, INT_MAX) &&
+//    Query::priceBetween(0, 40)).orderBy(SortKey::Price).limit(10)
+// Title and author match substrings (case-sensitive, like searchByTitle);
+// ranges are inclusive. Library::forEachWhere evaluates it.
+class Query {
+public:
+    enum class Kind { All, Title, Author, Isbn, Year, Price, And, Or };
+
+private:
+    friend class Library;
+
+    Kind kind = Kind::All;
+    string text;
+    double lo = 0, hi = 0;
+    vector<Query> children;
+    bool ordered = false;
+    SortKey orderKey = SortKey::Price;
+    bool descending = false;
+    size_t maxResults = static_cast<size_t>(-1);
+
+    static Query leaf(Kind kind, string text, double lo = 0, double hi = 0) {
+        Query query;
+        query.kind = kind;
+        query.text = std::move(text);
+        query.lo = lo;
+        query.hi = hi;
+        return query;
+    }
+
+    static Query join(Kind kind, Query a, Query b) {
+        Query query;
+        query.kind = kind;
+        // Flatten chains like a && b && c into one node
+        for (Query *side : {&a, &b}) {
+            if (side->kind == kind) {
+                for (auto &child : side->children) {
+                    query.children.push_back(std::move(child));
+                }
+            } else {
+                query.children.push_back(std::move(*side));
+            }
+        }
+        return query;
+    }
+
+public:
+    // Matches every book
+    static Query all() {
+        return Query();
+    }
+
+    static Query title(string contains) {
+        return leaf(Kind::Title, std::move(contains));
+    }
+
+    static Query author(string contains) {
+        return leaf(Kind::Author, std::move(contains));
+    }
+
+    static Query isbn(string equals) {
+        return leaf(Kind::Isbn, std::move(equals));
+    }
+
+    static Query yearBetween(int from, int to) {
+        return leaf(Kind::Year, "", from, to);
+    }
+
+    static Query priceBetween(double lo, double hi) {
+        return leaf(Kind::Price, "", lo, hi);
+    }
+
+    friend Query operator&&(Query a, Query b) {
+        return join(Kind::And, std::move(a), std::move(b));
+    }
+
+    friend Query operator||(Query a, Query b) {
+        return join(Kind::Or, std::move(a), std::move(b));
+    }
+
+    // Return matches ordered by key (ties in catalog order) instead of catalog order
+    Query &orderBy(SortKey key, bool descend = false) {
+        ordered = true;
+        orderKey = key;
+        descending = descend;
+        return *this;
+    }
+
+    // Stop after n matches
+    Query &limit(size_t n) {
+        maxResults = n;
+        return *this;
+    }
+
+    bool matches(const Book &book) const {
+        switch (kind) {
+        case Kind::All:
+            return true;
+        case Kind::Title:
+            return book.title.find(text) != string::npos;
+        case Kind::Author:
+            return book.author.find(text) != string::npos;
+        case Kind::Isbn:
+            return IsbnKey::same(book.isbn, text);
+        case Kind::Year:
+            return lo <= book.year && book.year <= hi;
+        case Kind::Price:
+            return lo <= book.price && book.price <= hi;
+        case Kind::And:
+            return all_of(children.begin(), children.end(), [&](const Query &q) { return q.matches(book); });
+        case Kind::Or:
+            return any_of(children.begin(), children.end(), [&](const Query &q) { return q.matches(book); });
+        }
+        return false;
+    }
+
+    // The predicate in readable form
+    string describe() const {
+        ostringstream out;
+        switch (kind) {
+        case Kind::All:
+            out << "true";
+            break;
+        case Kind::Title:
+            out << "title contains '" << text << "'";
+            break;
+        case Kind::Author:
+            out << "author contains '" << text << "'";
+            break;
+        case Kind::Isbn:
+            out << "isbn = '" << text << "'";
+            break;
+        case Kind::Year:
+            out << "year in [" << static_cast<long long>(lo) << ", " << static_cast<long long>(hi) << "]";
+            break;
+        case Kind::Price:
+            out << "price in [" << lo << ", " << hi << "]";
+            break;
+        case Kind::And:
+        case Kind::Or:
+            out << "(";
+            for (size_t i = 0; i < children.size(); ++i) {
+                out << (i ? (kind == Kind::And ? " AND " : " OR ") : "") << children[i].describe();
+            }
+            out << ")";
+            break;
+        }
+        return out.str();
+    }
+};
+
+// Count, sum, min and max of the prices in one group of books
+struct PriceStats {
+    size_t count = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+
+    double mean() const {
+        return count == 0 ? 0 : sum / count;
+    }
+};
+
+// Per-author and per-year price statistics plus a catalog-wide price
+// histogram. Library keeps one up to date through add/remove with book ids:
+// each group also lists its members, with an id -> slot map so removal is a
+// swap-and-pop and min/max are only rescanned when an extreme leaves.
+// compute() builds a statistics-only copy (no member lists) for verification.
+// Sums are accumulated in long double to keep add/remove drift negligible.
+class CatalogAggregates {
+private:
+    struct Group {
+        size_t count = 0;
+        long double sum = 0;
+        double min = 0;
+        double max = 0;
+        vector<pair<double, uint32_t>> members;  // (price, id), maintained copies only
+    };
+
+    unordered_map<string, Group> authors;
+    map<int, Group> years;
+    size_t total = 0;
+    long double totalSum = 0;
+    double bucketWidth;
+    vector<size_t> histogram;  // The last bucket is open-ended
+    vector<uint32_t> authorSlot;  // id -> index in its author group's members
+    vector<uint32_t> yearSlot;    // id -> index in its year group's members
+
+    static void addTo(Group &group, double price) {
+        group.min = group.count == 0 ? price : std::min(group.min, price);
+        group.max = group.count == 0 ? price : std::max(group.max, price);
+        ++group.count;
+        group.sum += price;
+    }
+
+    static void mergeInto(Group &into, const Group &from) {
+        into.min = into.count == 0 ? from.min : std::min(into.min, from.min);
+        into.max = into.count == 0 ? from.max : std::max(into.max, from.max);
+        into.count += from.count;
+        into.sum += from.sum;
+    }
+
+    static void addMember(Group &group, vector<uint32_t> &slots, double price, uint32_t id) {
+        if (slots.size() <= id) {
+            slots.resize(id + 1);
+        }
+        slots[id] = static_cast<uint32_t>(group.members.size());
+        group.members.emplace_back(price, id);
+        addTo(group, price);
+    }
+
+    // Take the member out of the group; true once the group is empty
+    static bool removeMember(Group &group, vector<uint32_t> &slots, double price, uint32_t id) {
+        uint32_t slot = slots[id];
+        group.members[slot] = group.members.back();
+        slots[group.members[slot].second] = slot;
+        group.members.pop_back();
+        if (--group.count == 0) {
+            return true;
+        }
+        group.sum -= price;
+        if (price == group.min || price == group.max) {
+            group.min = group.max = group.members.front().first;
+            for (const auto &member : group.members) {
+                group.min = std::min(group.min, member.first);
+                group.max = std::max(group.max, member.first);
+            }
+        }
+        return false;
+    }
+
+    static PriceStats statsOf(const Group &group) {
+        PriceStats stats;
+        stats.count = group.count;
+        stats.sum = static_cast<double>(group.sum);
+        stats.min = group.min;
+        stats.max = group.max;
+        return stats;
+    }
+
+    static bool sameSum(long double a, long double b) {
+        return fabsl(a - b) <= 1e-9L * std::max<long double>(1, fabsl(a));
+    }
+
+    static bool sameGroup(const Group &a, const Group &b) {
+        return a.count == b.count && a.min == b.min && a.max == b.max && sameSum(a.sum, b.sum);
+    }
+
+    size_t bucketOf(double price) const {
+        if (!(price > 0)) {
+            return 0;
+        }
+        double bucket = price / bucketWidth;
+        return bucket >= histogram.size() - 1 ? histogram.size() - 1 : static_cast<size_t>(bucket);
+    }
+
+public:
+    explicit CatalogAggregates(double bucketWidth = 10.0, size_t bucketCount = 32)
+        : bucketWidth(bucketWidth > 0 ? bucketWidth : 1.0), histogram(std::max<size_t>(1, bucketCount)) {}
+
+    // Count a book that will later be removed by the same id
+    void add(const Book &book, uint32_t id) {
+        addMember(authors[book.author], authorSlot, book.price, id);
+        addMember(years[book.year], yearSlot, book.price, id);
+        ++total;
+        totalSum += book.price;
+        ++histogram[bucketOf(book.price)];
+    }
+
+    // Uncount a book previously added with add(book, id)
+    void remove(const Book &book, uint32_t id) {
+        auto author = authors.find(book.author);
+        if (removeMember(author->second, authorSlot, book.price, id)) {
+            authors.erase(author);
+        }
+        auto year = years.find(book.year);
+        if (removeMember(year->second, yearSlot, book.price, id)) {
+            years.erase(year);
+        }
+        if (--total == 0) {
+            totalSum = 0;
+        } else {
+            totalSum -= book.price;
+        }
+        --histogram[bucketOf(book.price)];
+    }
+
+    // Count a book in statistics-only aggregates (no later removal)
+    void add(const Book &book) {
+        addTo(authors[book.author], book.price);
+        addTo(years[book.year], book.price);
+        ++total;
+        totalSum += book.price;
+        ++histogram[bucketOf(book.price)];
+    }
+
+    void clear() {
+        authors.clear();
+        years.clear();
+        total = 0;
+        totalSum = 0;
+        fill(histogram.begin(), histogram.end(), 0);
+        authorSlot.clear();
+        yearSlot.clear();
+    }
+
+    // Fold in statistics-only aggregates built with the same histogram layout
+    void merge(const CatalogAggregates &other) {
+        for (const auto &entry : other.authors) {
+            mergeInto(authors[entry.first], entry.second);
+        }
+        for (const auto &entry : other.years) {
+            mergeInto(years[entry.first], entry.second);
+        }
+        total += other.total;
+        totalSum += other.totalSum;
+        for (size_t i = 0; i < histogram.size() && i < other.histogram.size(); ++i) {
+            histogram[i] += other.histogram[i];
+        }
+    }
+
+    // Statistics for one author or year, or nullopt if it has no books
+    optional<PriceStats> author(const string &name) const {
+        auto it = authors.find(name);
+        return it == authors.end() ? nullopt : optional<PriceStats>(statsOf(it->second));
+    }
+
+    optional<PriceStats> year(int value) const {
+        auto it = years.find(value);
+        return it == years.end() ? nullopt : optional<PriceStats>(statsOf(it->second));
+    }
+
+    // Statistics over the whole catalog; min and max fold the year groups
+    PriceStats all() const {
+        Group overall;
+        for (const auto &entry : years) {
+            mergeInto(overall, entry.second);
+        }
+        overall.sum = totalSum;
+        return statsOf(overall);
+    }
+
+    // Every author with its statistics, in no particular order
+    vector<pair<string, PriceStats>> byAuthor() const {
+        vector<pair<string, PriceStats>> result;
+        result.reserve(authors.size());
+        for (const auto &entry : authors) {
+            result.emplace_back(entry.first, statsOf(entry.second));
+        }
+        return result;
+    }
+
+    // Every year with its statistics, oldest first
+    vector<pair<int, PriceStats>> byYear() const {
+        vector<pair<int, PriceStats>> result;
+        result.reserve(years.size());
+        for (const auto &entry : years) {
+            result.emplace_back(entry.first, statsOf(entry.second));
+        }
+        return result;
+    }
+
+    // Books per price bucket: bucket i holds [i * width, (i + 1) * width), the
+    // first also non-positive prices and the last everything above
+    const vector<size_t> &priceHistogram() const {
+        return histogram;
+    }
+
+    double histogramBucketWidth() const {
+        return bucketWidth;
+    }
+
+    // Same groups, counts, extremes and histogram; sums may differ by rounding
+    bool matches(const CatalogAggregates &other) const {
+        if (authors.size() != other.authors.size() || years.size() != other.years.size() ||
+            total != other.total || histogram != other.histogram || !sameSum(totalSum, other.totalSum)) {
+            return false;
+        }
+        for (const auto &entry : authors) {
+            auto it = other.authors.find(entry.first);
+            if (it == other.authors.end() || !sameGroup(entry.second, it->second)) {
+                return false;
+            }
+        }
+        for (const auto &entry : years) {
+            auto it = other.years.find(entry.first);
+            if (it == other.years.end() || !sameGroup(entry.second, it->second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Build statistics-only aggregates from scratch, splitting the books across
+    // a worker pool (threads = 0 uses every hardware thread) and merging the
+    // partial results
+    static CatalogAggregates compute(const vector<Book> &books, double bucketWidth = 10.0,
+                                     size_t bucketCount = 32, size_t threads = 0) {
+        ThreadPool pool(threads);
+        size_t chunks = std::min(books.size(), pool.size() * 4);
+        vector<future<CatalogAggregates>> partials;
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t begin = books.size() * c / chunks;
+            size_t end = books.size() * (c + 1) / chunks;
+            partials.push_back(pool.submit([&books, begin, end, bucketWidth, bucketCount] {
+                CatalogAggregates partial(bucketWidth, bucketCount);
+                for (size_t i = begin; i < end; ++i) {
+                    partial.add(books[i]);
+                }
+                return partial;
+            }));
+        }
+        CatalogAggregates result(bucketWidth, bucketCount);
+        for (auto &partial : partials) {
+            result.merge(partial.get());
+        }
+        return result;
+    }
+};
+
+// Stable reference to a book in a Library. It survives sorts and the removal
+// of other books, and goes stale (rather than aliasing) once its own book is
+// removed, even after the slot is reused: each reuse bumps the generation.
+struct BookHandle {
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool operator==(const BookHandle &other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+    bool operator!=(const BookHandle &other) const {
+        return !(*this == other);
+    }
+};
+
+// Hit/miss counters of a QueryCache
+struct QueryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t capacity = 0;
+};
+
+// Bounded LRU cache of search results keyed by query kind and text. Entries
+// carry the generation they were computed at and invalidate() bumps the
+// generation, so a mutation costs O(1) and stale entries are dropped when
+// next looked up or evicted. A mutex guards the table so const searches may
+// still run concurrently. Copies keep the capacity but start empty.
+class QueryCache {
+public:
+    enum Kind : char { Title = 't', Author = 'a' };
+    using Results = shared_ptr<const vector<Book>>;
+
+private:
+    struct Entry {
+        string key;
+        uint64_t generation;
+        Results books;
+    };
+
+    mutable mutex guard;
+    mutable list<Entry> lru;  // Most recently used first
+    mutable unordered_map<string_view, list<Entry>::iterator> entries;  // Views into Entry::key
+    size_t capacity = 0;
+    uint64_t generation = 0;
+    mutable QueryCacheStats counters;
+
+    static string makeKey(Kind kind, const string &text) {
+        string key(1, kind);
+        key += text;
+        return key;
+    }
+
+    void dropAll() {
+        entries.clear();
+        lru.clear();
+    }
+
+public:
+    QueryCache() = default;
+    QueryCache(const QueryCache &other) : capacity(other.capacity) {}
+
+    QueryCache &operator=(const QueryCache &other) {
+        if (this != &other) {
+            lock_guard<mutex> lock(guard);
+            dropAll();
+            capacity = other.capacity;
+            counters = QueryCacheStats();
+        }
+        return *this;
+    }
+
+    bool enabled() const {
+        return capacity != 0;
+    }
+
+    // Keep at most n results; 0 disables the cache and frees its entries
+    void setCapacity(size_t n) {
+        lock_guard<mutex> lock(guard);
+        capacity = n;
+        while (lru.size() > capacity) {
+            entries.erase(lru.back().key);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+    }
+
+    // Forget every cached result
+    void invalidate() {
+        if (capacity == 0) {
+            return;
+        }
+        lock_guard<mutex> lock(guard);
+        ++generation;
+    }
+
+    // Cached results for the query, or nullptr on a miss
+    Results find(Kind kind, const string &text) const {
+        lock_guard<mutex> lock(guard);
+        auto it = entries.find(makeKey(kind, text));
+        if (it == entries.end()) {
+            ++counters.misses;
+            return nullptr;
+        }
+        if (it->second->generation != generation) {
+            auto stale = it->second;
+            entries.erase(it);
+            lru.erase(stale);
+            ++counters.misses;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        ++counters.hits;
+        return it->second->books;
+    }
+
+    // Remember results computed at the current generation
+    void store(Kind kind, const string &text, Results books) const {
+        lock_guard<mutex> lock(guard);
+        if (capacity == 0) {
+            return;
+        }
+        string key = makeKey(kind, text);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            it->second->generation = generation;
+            it->second->books = std::move(books);
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        if (lru.size() == capacity) {
+            entries.erase(lru.back().key);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+        lru.push_front(Entry{std::move(key), generation, std::move(books)});
+        entries.emplace(lru.front().key, lru.begin());
+    }
+
+    QueryCacheStats stats() const {
+        lock_guard<mutex> lock(guard);
+        QueryCacheStats result = counters;
+        result.entries = lru.size();
+        result.capacity = capacity;
+        return result;
+    }
+
+    void resetStats() {
+        lock_guard<mutex> lock(guard);
+        counters = QueryCacheStats();
+    }
+};
+
+// ISBN -> id map. Valid ISBNs are keyed by IsbnKey, so formatting
+// differences resolve to the same book; anything else falls back to the
+// exact string.
+class IsbnIndex {
+private:
+    unordered_map<IsbnKey, uint32_t> keys;
+    unordered_map<string, uint32_t> others;
+
+public:
+    // Add isbn -> id; false if the ISBN (in any formatting) is already present
+    bool emplace(const string &isbn, uint32_t id) {
+        if (auto key = IsbnKey::parse(isbn)) {
+            return keys.emplace(*key, id).second;
+        }
+        return others.emplace(isbn, id).second;
+    }
+
+    // Id for isbn, or nullptr if absent
+    const uint32_t *find(const string &isbn) const {
+        if (auto key = IsbnKey::parse(isbn)) {
+            auto it = keys.find(*key);
+            return it == keys.end() ? nullptr : &it->second;
+        }
+        auto it = others.find(isbn);
+        return it == others.end() ? nullptr : &it->second;
+    }
+
+    void erase(const string &isbn) {
+        if (auto key = IsbnKey::parse(isbn)) {
+            keys.erase(*key);
+        } else {
+            others.erase(isbn);
+        }
+    }
+
+    void clear() {
+        keys.clear();
+        others.clear();
+    }
+
+    // Reserve for n valid ISBNs, the common case
+    void reserve(size_t n) {
+        keys.reserve(n);
+    }
+
+    size_t size() const {
+        return keys.size() + others.size();
+    }
+
+    // Heap held by both tables, including fallback strings too long for SSO
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage = hashTableUsage(keys);
+        MemoryUsage fallback = hashTableUsage(others);
+        usage.bytes += fallback.bytes;
+        usage.allocations += fallback.allocations;
+        const size_t inlineCapacity = string().capacity();
+        for (const auto &entry : others) {
+            if (entry.first.capacity() > inlineCapacity) {
+                usage.bytes += entry.first.capacity() + 1;
+                ++usage.allocations;
+            }
+        }
+        return usage;
+    }
+};
+
+// Outcome of writing a catalog file
+struct SaveResult {
+    bool ok = false;
+    uint64_t bytes = 0;
+    string error;
+};
+
+// Write books as a text catalog to a uniquely named temp file, fsync it and
+// rename it over filename, so readers only ever see a complete catalog
+SaveResult writeCatalogAtomically(const string &filename, const vector<Book> &books) {
+    static atomic<unsigned> sequence{0};
+    SaveResult result;
+    string tempName = filename + ".tmp." + to_string(getpid()) + "." + to_string(sequence++);
+    auto fail = [&](const string &what) {
+        result.error = what + ": " + strerror(errno);
+        remove(tempName.c_str());
+        return result;
+    };
+
+    ofstream file(tempName, ios::trunc);
+    if (!file.is_open()) {
+        return fail("cannot create " + tempName);
+    }
+    for (const auto &book : books) {
+        book.saveToFile(file);
+    }
+    result.bytes = static_cast<uint64_t>(file.tellp());
+    file.close();
+    if (file.fail()) {
+        return fail("cannot write " + tempName);
+    }
+    LIBRARY_RECORD(BytesWritten, result.bytes);
+
+    int fd = ::open(tempName.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!synced) {
+        return fail("cannot sync " + tempName);
+    }
+    if (rename(tempName.c_str(), filename.c_str()) != 0) {
+        return fail("cannot rename " + tempName + " to " + filename);
+    }
+    result.ok = true;
+    return result;
+}
+
+// Run task() on its own thread via std::async; onDone (if set) sees the
+// result on that thread before the future becomes ready. The returned
+// future owns the thread: destroying it waits for the save to finish, so no
+// save outlives its caller or is cut short at exit.
+template <typename Task>
+future<SaveResult> runSaveInBackground(Task task, function<void(const SaveResult &)> onDone) {
+    return async(launch::async, [task = std::move(task), onDone = std::move(onDone)]() mutable {
+        SaveResult outcome = task();
+        if (onDone) {
+            onDone(outcome);
+        }
+        return outcome;
+    });
+}
+
 // Class to handle the library system
 class Library {
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
 private:
     vector<Book> books;
 
+    // Stable ids survive the position shifts caused by removals and sorts
+    vector<uint32_t> bookIds;   // position -> id
+    vector<size_t> idPositions; // id -> position, npos once removed
+
+    // Handle table: slot -> (id, generation), recycled through freeSlots.
+    // Slots are reused with a bumped generation; ids never are, so index
+    // tie-breaking by id still follows insertion order.
+    static constexpr uint32_t freeSlot = UINT32_MAX;
+    struct Slot {
+        uint32_t id;
+        uint32_t generation;
+    };
+    vector<Slot> slots;
+    vector<uint32_t> freeSlots;
+    vector<uint32_t> idSlots;         // id -> slot
+    uint32_t generationFloor = 0;     // Starting generation for slots appended after compact()
+
+    IsbnIndex isbnIndex; // ISBN -> id
+
+    // Numeric columns mirroring books[i].year and books[i].price for range scans
+    vector<int> yearColumn;
+    vector<double> priceColumn;
+
+    bool substringIndexEnabled = false;
+    TrigramIndex titleGrams;
+    TrigramIndex authorGrams;
+
+    bool fuzzyIndexEnabled = false;
+    TrigramIndex foldedTitleGrams{true};
+    TrigramIndex foldedAuthorGrams{true};
+
+    bool autocompleteEnabled = false;
+    PrefixIndex titlePrefixes;
+    PrefixIndex authorPrefixes;
+
+    bool orderedIndexesEnabled = false;
+    OrderedIndex<double> priceOrder;
+    OrderedIndex<int> yearOrder;
+    OrderedIndex<string> titleOrder;
+    OrderedIndex<string> authorOrder;
+
+    QueryCache queryCache;  // searchByTitle/searchByAuthor results, off by default
+
+    bool aggregatesEnabled = false;
+    CatalogAggregates aggregates;
+
+    JournalPtr journal;
+    string journalSnapshot;       // Snapshot file the journal belongs to
+    uint64_t journalCompactBytes = 0;
+    bool journalFailed = false;   // Set once a journal write or compaction failed
+
+    // Remember a journal write, fsync or compaction failure; later mutations
+    // are no longer guaranteed to be durable
+    void journalFailure() {
+        if (!journalFailed) {
+            cout << "Error writing journal!" << endl;
+        }
+        journalFailed = true;
+    }
+
+    // Append a record for a mutation that has already been applied
+    void appendJournal(Journal::Op op, const Book &book) {
+        if (journal && !journal->append(op, book)) {
+            journalFailure();
+        }
+    }
+
+    // Fold the journal into a fresh snapshot once it grows too large. Only
+    // call this after the mutation being logged is fully applied, otherwise
+    // the snapshot would disagree with the journal it replaces.
+    void compactJournalIfDue() {
+        if (journal && journal->size() >= journalCompactBytes && !compactJournal()) {
+            journalFailure();
+        }
+    }
+
+    // Log an applied mutation when journaling
+    void logMutation(Journal::Op op, const Book &book) {
+        appendJournal(op, book);
+        compactJournalIfDue();
+    }
+
+    // Position of the book with the given ISBN, or npos if absent
+    size_t findPosition(const string &isbn) const {
+        const uint32_t *id = isbnIndex.find(isbn);
+        return id == nullptr ? npos : idPositions[*id];
+    }
+
+    // Give a new id a handle slot, reusing a freed one when possible
+    void allocateSlot(uint32_t id) {
+        uint32_t slot;
+        if (freeSlots.empty()) {
+            slot = static_cast<uint32_t>(slots.size());
+            slots.push_back({id, generationFloor});
+        } else {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            slots[slot].id = id;
+        }
+        idSlots.push_back(slot);
+    }
+
+    // Tombstone the slot of a removed id so outstanding handles go stale
+    void releaseSlot(uint32_t id) {
+        uint32_t slot = idSlots[id];
+        slots[slot].id = freeSlot;
+        ++slots[slot].generation;
+        freeSlots.push_back(slot);
+    }
+
+    // Position of the book a handle refers to, or npos if it is stale
+    size_t handlePosition(BookHandle handle) const {
+        if (handle.slot >= slots.size()) {
+            return npos;
+        }
+        const Slot &slot = slots[handle.slot];
+        return slot.id == freeSlot || slot.generation != handle.generation ? npos : idPositions[slot.id];
+    }
+
+    // Re-point the ids of books[from..] after their positions changed
+    void reindexFrom(size_t from) {
+        for (size_t i = from; i < books.size(); ++i) {
+            idPositions[bookIds[i]] = i;
+        }
+    }
+
+    // Register the book at pos with the enabled secondary indexes
+    void indexSecondary(size_t pos) {
+        const Book &book = books[pos];
+        uint32_t id = bookIds[pos];
+        if (substringIndexEnabled) {
+            titleGrams.add(id, book.title);
+            authorGrams.add(id, book.author);
+        }
+        if (fuzzyIndexEnabled) {
+            foldedTitleGrams.add(id, book.title);
+            foldedAuthorGrams.add(id, book.author);
+        }
+        if (autocompleteEnabled) {
+            titlePrefixes.add(book.title);
+            authorPrefixes.add(book.author);
+        }
+        if (orderedIndexesEnabled) {
+            priceOrder.add(book.price, id);
+            yearOrder.add(book.year, id);
+            titleOrder.add(book.title, id);
+            authorOrder.add(book.author, id);
+        }
+        if (aggregatesEnabled) {
+            aggregates.add(book, id);
+        }
+    }
+
+    // Drop the book at pos from the enabled secondary indexes
+    void unindexSecondary(size_t pos) {
+        const Book &book = books[pos];
+        uint32_t id = bookIds[pos];
+        if (substringIndexEnabled) {
+            titleGrams.remove(id, book.title);
+            authorGrams.remove(id, book.author);
+        }
+        if (fuzzyIndexEnabled) {
+            foldedTitleGrams.remove(id, book.title);
+            foldedAuthorGrams.remove(id, book.author);
+        }
+        if (autocompleteEnabled) {
+            titlePrefixes.remove(book.title);
+            authorPrefixes.remove(book.author);
+        }
+        if (orderedIndexesEnabled) {
+            priceOrder.remove(book.price, id);
+            yearOrder.remove(book.year, id);
+            titleOrder.remove(book.title, id);
+            authorOrder.remove(book.author, id);
+        }
+        if (aggregatesEnabled) {
+            aggregates.remove(book, id);
+        }
+    }
+
+    // Visit books in index order until visit returns false. Descending walks
+    // take the keys from the back but each run of equal keys in ascending id
+    // order, matching the comparison path in forEachWhere.
+    template <typename Key, typename Visit>
+    void visitIndex(const OrderedIndex<Key> &index, bool descending, Visit &visit) const {
+        if (descending) {
+            auto groupEnd = index.end();
+            while (groupEnd != index.begin()) {
+                auto groupStart = index.lowerBound(prev(groupEnd)->first);
+                for (auto it = groupStart; it != groupEnd; ++it) {
+                    if (!visit(books[idPositions[it->second]])) {
+                        return;
+                    }
+                }
+                groupEnd = groupStart;
+            }
+        } else {
+            for (const auto &entry : index) {
+                if (!visit(books[idPositions[entry.second]])) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Visit books ordered by key, then ascending id, without an index by sorting positions
+    template <typename Key, typename Visit>
+    void visitSorted(Key Book::*field, bool descending, Visit &visit) const {
+        vector<size_t> order(books.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            const Key &x = books[a].*field, &y = books[b].*field;
+            if (descending ? y < x : x < y) {
+                return true;
+            }
+            if (descending ? x < y : y < x) {
+                return false;
+            }
+            return bookIds[a] < bookIds[b];
+        });
+        for (size_t pos : order) {
+            if (!visit(books[pos])) {
+                return;
+            }
+        }
+    }
+
+    // Stably reorder books by key(pos), a sortable unsigned integer, using the
+    // requested algorithm to compute the permutation and applying it once
+    template <typename Key, typename KeyOf>
+    void sortBooks(SortAlgorithm algorithm, size_t threads, KeyOf key) {
+        if (algorithm == SortAlgorithm::Auto) {
+            if (books.size() < 256) {
+                algorithm = SortAlgorithm::Comparison;
+            } else if (books.size() >= (1U << 18) && threads != 1 && thread::hardware_concurrency() > 1) {
+                algorithm = SortAlgorithm::ParallelRadix;
+            } else {
+                algorithm = SortAlgorithm::Radix;
+            }
+        }
+
+        unique_ptr<ThreadPool> pool;
+        if (algorithm == SortAlgorithm::ParallelRadix) {
+            pool = make_unique<ThreadPool>(threads);
+        }
+        vector<uint32_t> order;
+        if (algorithm == SortAlgorithm::Comparison) {
+            order.resize(books.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = static_cast<uint32_t>(i);
+            }
+            stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return key(a) < key(b);
+            });
+        } else {
+            vector<SortItem<Key>> items(books.size());
+            for (size_t i = 0; i < items.size(); ++i) {
+                items[i] = {key(i), static_cast<uint32_t>(i)};
+            }
+            order = radixOrder(std::move(items), pool.get());
+        }
+        applyOrder(order, pool.get());
+    }
+
+    // Move the book at order[i] to position i, keeping ids and indexes in step
+    void applyOrder(const vector<uint32_t> &order, ThreadPool *pool) {
+        vector<Book> sortedBooks(books.size());
+        vector<uint32_t> sortedIds(books.size());
+        size_t chunks = pool == nullptr ? 1 : max<size_t>(1, min(pool->size(), books.size() / 65536));
+        runChunks(chunks, pool, [&](size_t c) {
+            for (size_t i = books.size() * c / chunks, end = books.size() * (c + 1) / chunks; i < end; ++i) {
+                sortedBooks[i] = std::move(books[order[i]]);
+                sortedIds[i] = bookIds[order[i]];
+                yearColumn[i] = sortedBooks[i].year;
+                priceColumn[i] = sortedBooks[i].price;
+            }
+        });
+        books.swap(sortedBooks);
+        bookIds.swap(sortedIds);
+        reindexFrom(0);
+        queryCache.invalidate();
+    }
+
+    // Books with lo <= field <= hi ordered by (field, id)
+    template <typename Key>
+    vector<Book> orderedRange(const OrderedIndex<Key> &index, Key Book::*field, Key lo, Key hi) const {
+        vector<Book> result;
+        if (orderedIndexesEnabled) {
+            for (auto it = index.lowerBound(lo), end = index.upperBound(hi); it != end; ++it) {
+                result.push_back(books[idPositions[it->second]]);
+            }
+            LIBRARY_RECORD(Scanned, result.size());
+            return result;
+        }
+        LIBRARY_RECORD(Scanned, books.size());
+
+        vector<size_t> matches;
+        for (size_t i = 0; i < books.size(); ++i) {
+            if (lo <= books[i].*field && books[i].*field <= hi) {
+                matches.push_back(i);
+            }
+        }
+        sort(matches.begin(), matches.end(), [&](size_t a, size_t b) {
+            return make_pair(books[a].*field, bookIds[a]) < make_pair(books[b].*field, bookIds[b]);
+        });
+        for (size_t pos : matches) {
+            result.push_back(books[pos]);
+        }
+        return result;
+    }
+
+    // Visit the positions of books whose field contains the query, in catalog
+    // order, until visit returns false. Uses the trigram index to narrow
+    // candidates when it is enabled.
+    template <typename Visit>
+    void scanField(string Book::*field, const TrigramIndex &grams, const string &query,
+                   Visit visit) const {
+        vector<uint32_t> ids;
+        if (substringIndexEnabled && grams.candidates(query, ids)) {
+            vector<size_t> positions;
+            positions.reserve(ids.size());
+            for (uint32_t id : ids) {
+                positions.push_back(idPositions[id]);
+            }
+            sort(positions.begin(), positions.end());
+            for (size_t i = 0; i < positions.size(); ++i) {
+                if ((books[positions[i]].*field).find(query) != string::npos && !visit(positions[i])) {
+                    LIBRARY_RECORD(Scanned, i + 1);
+                    return;
+                }
+            }
+            LIBRARY_RECORD(Scanned, positions.size());
+            return;
+        }
+
+        for (size_t pos = 0; pos < books.size(); ++pos) {
+            if ((books[pos].*field).find(query) != string::npos && !visit(pos)) {
+                LIBRARY_RECORD(Scanned, pos + 1);
+                return;
+            }
+        }
+        LIBRARY_RECORD(Scanned, books.size());
+    }
+
+    // searchField answered from the query cache when it is enabled
+    vector<Book> cachedSearch(QueryCache::Kind kind, string Book::*field, const TrigramIndex &grams,
+                              const string &query) const {
+        if (!queryCache.enabled()) {
+            return searchField(field, grams, query);
+        }
+        if (auto hit = queryCache.find(kind, query)) {
+            return *hit;
+        }
+        auto computed = make_shared<const vector<Book>>(searchField(field, grams, query));
+        queryCache.store(kind, query, computed);
+        return *computed;
+    }
+
+    // Copies of the books whose field contains the query
+    vector<Book> searchField(string Book::*field, const TrigramIndex &grams,
+                             const string &query) const {
+        vector<Book> result;
+        scanField(field, grams, query, [&](size_t pos) {
+            result.push_back(books[pos]);
+            return true;
+        });
+        return result;
+    }
+
+    // One page of matching positions; stops scanning once the page is full
+    vector<size_t> pageField(string Book::*field, const TrigramIndex &grams, const string &query,
+                             size_t offset, size_t limit) const {
+        vector<size_t> page;
+        if (limit == 0) {
+            return page;
+        }
+        size_t skipped = 0;
+        scanField(field, grams, query, [&](size_t pos) {
+            if (skipped < offset) {
+                ++skipped;
+                return true;
+            }
+            page.push_back(pos);
+            return page.size() < limit;
+        });
+        return page;
+    }
+
+    // Up to limit books whose field matches the query within maxEdits edits,
+    // best first. Each edit can destroy at most three of the query's trigrams,
+    // so with the fuzzy index only books sharing enough of them are verified.
+    vector<FuzzyMatch> fuzzyField(string Book::*field, const TrigramIndex &grams, const string &query,
+                                  size_t maxEdits, size_t limit) const {
+        FuzzyPattern pattern(query);
+        vector<FuzzyMatch> matches;
+        auto verify = [&](size_t pos) {
+            size_t distance = pattern.distance(books[pos].*field);
+            if (distance <= maxEdits) {
+                matches.push_back({pos, distance});
+            }
+        };
+
+        size_t gramCount = fuzzyIndexEnabled ? grams.gramCount(query) : 0;
+        if (gramCount > 3 * maxEdits) {
+            vector<uint32_t> ids;
+            grams.sharedCandidates(query, gramCount - 3 * maxEdits, idPositions.size(), ids);
+            for (uint32_t id : ids) {
+                verify(idPositions[id]);
+            }
+            LIBRARY_RECORD(Scanned, ids.size());
+        } else {
+            for (size_t pos = 0; pos < books.size(); ++pos) {
+                verify(pos);
+            }
+            LIBRARY_RECORD(Scanned, books.size());
+        }
+
+        // Fewest edits first, then the closest overall length, then catalog order
+        auto better = [&](const FuzzyMatch &a, const FuzzyMatch &b) {
+            auto key = [&](const FuzzyMatch &match) {
+                size_t length = (books[match.position].*field).size();
+                size_t slack = length > pattern.size() ? length - pattern.size() : pattern.size() - length;
+                return make_tuple(match.distance, slack, match.position);
+            };
+            return key(a) < key(b);
+        };
+        if (limit < matches.size()) {
+            partial_sort(matches.begin(), matches.begin() + limit, matches.end(), better);
+            matches.resize(limit);
+        } else {
+            sort(matches.begin(), matches.end(), better);
+        }
+        return matches;
+    }
+
+    // Where a query's candidates come from: a sorted list of positions from
+    // an index, or every book when scan is set
+    struct AccessPath {
+        string description;
+        bool scan = true;
+        vector<size_t> positions;
+    };
+
+    static size_t sortedPositions(vector<size_t> &positions) {
+        sort(positions.begin(), positions.end());
+        positions.erase(unique(positions.begin(), positions.end()), positions.end());
+        return positions.size();
+    }
+
+    // An indexed access path for query with at most cap candidates, if there is one
+    bool indexedPath(const Query &query, size_t cap, AccessPath &path) const {
+        path.positions.clear();
+        path.scan = false;
+        switch (query.kind) {
+        case Query::Kind::Isbn: {
+            size_t pos = findPosition(query.text);
+            if (pos != npos) {
+                path.positions.push_back(pos);
+            }
+            path.description = "isbn lookup";
+            return path.positions.size() <= cap;
+        }
+        case Query::Kind::Title:
+        case Query::Kind::Author: {
+            bool title = query.kind == Query::Kind::Title;
+            vector<uint32_t> ids;
+            if (!substringIndexEnabled || !(title ? titleGrams : authorGrams).candidates(query.text, ids) ||
+                ids.size() > cap) {
+                return false;
+            }
+            for (uint32_t id : ids) {
+                path.positions.push_back(idPositions[id]);
+            }
+            sortedPositions(path.positions);
+            path.description = title ? "trigram index on title" : "trigram index on author";
+            return true;
+        }
+        case Query::Kind::Year:
+        case Query::Kind::Price: {
+            if (!orderedIndexesEnabled) {
+                return false;
+            }
+            auto collect = [&](const auto &index, auto lo, auto hi) {
+                for (auto it = index.lowerBound(lo), end = index.upperBound(hi); it != end; ++it) {
+                    if (path.positions.size() == cap) {
+                        return false;
+                    }
+                    path.positions.push_back(idPositions[it->second]);
+                }
+                return true;
+            };
+            bool year = query.kind == Query::Kind::Year;
+            bool fits = year ? collect(yearOrder, static_cast<int>(max<double>(query.lo, INT_MIN)),
+                                       static_cast<int>(min<double>(query.hi, INT_MAX)))
+                             : collect(priceOrder, query.lo, query.hi);
+            sortedPositions(path.positions);
+            path.description = year ? "ordered index on year" : "ordered index on price";
+            return fits;
+        }
+        case Query::Kind::And: {
+            // The smallest candidate set among the conjuncts; each must beat the best so far
+            bool found = false;
+            AccessPath candidate;
+            for (const Query &child : query.children) {
+                if (indexedPath(child, found ? path.positions.size() : cap, candidate) &&
+                    (!found || candidate.positions.size() < path.positions.size())) {
+                    path = std::move(candidate);
+                    found = true;
+                }
+            }
+            return found;
+        }
+        case Query::Kind::Or: {
+            // Only when every alternative has an index; the union of their candidates
+            vector<size_t> merged;
+            vector<string> parts;
+            AccessPath candidate;
+            for (const Query &child : query.children) {
+                if (!indexedPath(child, cap, candidate)) {
+                    return false;
+                }
+                merged.insert(merged.end(), candidate.positions.begin(), candidate.positions.end());
+                if (sortedPositions(merged) > cap) {
+                    return false;
+                }
+                parts.push_back(candidate.description);
+            }
+            path.positions = std::move(merged);
+            path.description = "union of (";
+            for (size_t i = 0; i < parts.size(); ++i) {
+                path.description += (i ? ", " : "") + parts[i];
+            }
+            path.description += ")";
+            return true;
+        }
+        case Query::Kind::All:
+            return false;
+        }
+        return false;
+    }
+
+    // Pick the access path for a query: the most selective index, else a
+    // vectorised column scan for a top-level year or price range, else a full scan
+    AccessPath planQuery(const Query &query) const {
+        AccessPath path;
+        if (indexedPath(query, books.size(), path)) {
+            return path;
+        }
+        vector<const Query *> conjuncts;
+        if (query.kind == Query::Kind::And) {
+            for (const Query &child : query.children) {
+                conjuncts.push_back(&child);
+            }
+        } else {
+            conjuncts.push_back(&query);
+        }
+        for (const Query *range : conjuncts) {
+            if (range->kind == Query::Kind::Year || range->kind == Query::Kind::Price) {
+                vector<uint64_t> mask((books.size() + 63) / 64);
+                if (range->kind == Query::Kind::Year) {
+                    rangeMask(yearColumn.data(), yearColumn.size(), static_cast<int>(max<double>(range->lo, INT_MIN)),
+                              static_cast<int>(min<double>(range->hi, INT_MAX)), mask.data());
+                } else {
+                    rangeMask(priceColumn.data(), priceColumn.size(), range->lo, range->hi, mask.data());
+                }
+                path.scan = false;
+                path.positions = maskPositions(mask);
+                path.description = range->kind == Query::Kind::Year ? "column scan on year" : "column scan on price";
+                return path;
+            }
+        }
+        path.scan = true;
+        path.positions.clear();
+        path.description = "full scan";
+        return path;
+    }
+
+    // Append a book unless its ISBN is already present
+    bool insertBook(Book &&book) {
+        uint32_t id = static_cast<uint32_t>(idPositions.size());
+        if (!isbnIndex.emplace(book.isbn, id)) {
+            return false;
+        }
+        queryCache.invalidate();
+        books.push_back(std::move(book));
+        yearColumn.push_back(books.back().year);
+        priceColumn.push_back(books.back().price);
+        bookIds.push_back(id);
+        idPositions.push_back(books.size() - 1);
+        allocateSlot(id);
+        indexSecondary(books.size() - 1);
+        logMutation(Journal::Add, books.back());
+        return true;
+    }
+
+    // Remove the book with the given ISBN; returns false if it is absent
+    bool eraseBook(const string &isbn) {
+        size_t pos = findPosition(isbn);
+        if (pos == npos) {
+            return false;
+        }
+        queryCache.invalidate();
+        unindexSecondary(pos);
+        isbnIndex.erase(books[pos].isbn);
+        idPositions[bookIds[pos]] = npos;
+        releaseSlot(bookIds[pos]);
+        Book removed = std::move(books[pos]);
+        books.erase(books.begin() + pos);
+        yearColumn.erase(yearColumn.begin() + pos);
+        priceColumn.erase(priceColumn.begin() + pos);
+        bookIds.erase(bookIds.begin() + pos);
+        reindexFrom(pos);
+        logMutation(Journal::Remove, removed);
+        return true;
+    }
+
+    // Remove every book flagged in doomed with a single compaction pass
+    void eraseFlagged(const vector<char> &doomed) {
+        size_t first = npos;
+        for (size_t pos = 0; pos < books.size(); ++pos) {
+            if (doomed[pos]) {
+                unindexSecondary(pos);
+                isbnIndex.erase(books[pos].isbn);
+                idPositions[bookIds[pos]] = npos;
+                releaseSlot(bookIds[pos]);
+                first = min(first, pos);
+            }
+        }
+        if (first == npos) {
+            return;
+        }
+        queryCache.invalidate();
+
+        vector<Book> removed;  // Journaled once the batch is applied
+        size_t kept = first;
+        for (size_t pos = first; pos < books.size(); ++pos) {
+            if (!doomed[pos]) {
+                books[kept] = std::move(books[pos]);
+                yearColumn[kept] = yearColumn[pos];
+                priceColumn[kept] = priceColumn[pos];
+                bookIds[kept] = bookIds[pos];
+                ++kept;
+            } else if (journal) {
+                removed.push_back(std::move(books[pos]));
+            }
+        }
+        books.resize(kept);
+        yearColumn.resize(kept);
+        priceColumn.resize(kept);
+        bookIds.resize(kept);
+        reindexFrom(first);
+
+        for (const auto &book : removed) {
+            appendJournal(Journal::Remove, book);
+        }
+        compactJournalIfDue();
+    }
+
+    // Drop every book and index entry
+    void eraseAll() {
+        queryCache.invalidate();
+        books.clear();
+        yearColumn.clear();
+        priceColumn.clear();
+        isbnIndex.clear();
+        bookIds.clear();
+        idPositions.clear();
+        for (const Slot &slot : slots) {
+            generationFloor = max(generationFloor, slot.generation + 1);
+        }
+        slots.clear();
+        freeSlots.clear();
+        idSlots.clear();
+        titleGrams.clear();
+        authorGrams.clear();
+        foldedTitleGrams.clear();
+        foldedAuthorGrams.clear();
+        titlePrefixes.clear();
+        authorPrefixes.clear();
+        priceOrder.clear();
+        yearOrder.clear();
+        titleOrder.clear();
+        authorOrder.clear();
+        aggregates.clear();
+        logMutation(Journal::Clear, Book());
+    }
+
+    // Write a text snapshot to a temp file, fsync it and rename it over filename
+    bool writeSnapshot(const string &filename) const {
+        return writeCatalogAtomically(filename, books).ok;
+    }
+
+    // Parse a text catalog stream in blocks on a worker pool and merge it in file order
+    void loadTextCatalog(ifstream &file, LoadReport &report, size_t threads, size_t blockSize) {
+        ThreadPool pool(threads);
+        deque<future<ParsedChunk>> pending;
+
+        auto merge = [&](ParsedChunk chunk) {
+            for (size_t i = 0; i < chunk.books.size(); ++i) {
+                string isbn = chunk.books[i].isbn;
+                if (insertBook(std::move(chunk.books[i]))) {
+                    ++report.loaded;
+                } else {
+                    chunk.errors.push_back({chunk.lines[i], "duplicate ISBN '" + isbn + "'"});
+                }
+            }
+            report.errors.insert(report.errors.end(), chunk.errors.begin(), chunk.errors.end());
+        };
+
+        auto dispatch = [&](string text, size_t firstLine) {
+            auto shared = make_shared<string>(std::move(text));
+            pending.push_back(pool.submit([shared, firstLine] {
+                return parseCatalogChunk(shared->data(), shared->data() + shared->size(), firstLine);
+            }));
+            // Bound memory: keep at most two blocks in flight per worker
+            while (pending.size() > 2 * pool.size()) {
+                merge(pending.front().get());
+                pending.pop_front();
+            }
+        };
+
+        string carry;
+        size_t nextLine = 1;
+        vector<char> block(max<size_t>(1, blockSize));
+        while (file) {
+            file.read(block.data(), block.size());
+            size_t got = static_cast<size_t>(file.gcount());
+            if (got == 0) {
+                break;
+            }
+            LIBRARY_RECORD(BytesRead, got);
+            string text = std::move(carry);
+            text.append(block.data(), got);
+
+            // Cut after the last newline that completes a five-line record
+            size_t lines = 0, cut = 0;
+            const char *cursor = text.data();
+            const char *end = text.data() + text.size();
+            while ((cursor = static_cast<const char *>(memchr(cursor, '\n', end - cursor))) != nullptr) {
+                ++cursor;
+                if (++lines % 5 == 0) {
+                    cut = cursor - text.data();
+                }
+            }
+            carry.assign(text, cut, string::npos);
+            text.resize(cut);
+            if (!text.empty()) {
+                dispatch(std::move(text), nextLine);
+                nextLine += lines - lines % 5;
+            }
+        }
+        if (!carry.empty()) {
+            dispatch(std::move(carry), nextLine);
+        }
+
+        while (!pending.empty()) {
+            merge(pending.front().get());
+            pending.pop_front();
+        }
+    }
+
+    // Apply the valid records of a journal file
+    void replayJournal(const string &path, LoadReport &report) {
+        uint64_t validBytes = 0;
+        vector<Journal::Record> records = Journal::read(path, &validBytes);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) > validBytes) {
+            report.tornJournalBytes = st.st_size - validBytes;
+        }
+        for (auto &record : records) {
+            if (record.op == Journal::Add) {
+                insertBook(std::move(record.book));
+            } else if (record.op == Journal::Remove) {
+                eraseBook(record.book.isbn);
+            } else if (record.op == Journal::Update) {
+                updateBookDetails(record.book);
+            } else {
+                eraseAll();
+            }
+            ++report.replayed;
+        }
+    }
 public:
-    // Add a new book to the library
-    void addBook(const Book &book) {
-        books.push_back(book);
+    // Default block size used when reading text catalogs
+    static constexpr size_t defaultLoadBlockSize = 8 << 20;
+
+    // Add a new book to the library; returns false if the ISBN is already present
+    bool addBook(const Book &book) {
+        LIBRARY_TRACE("addBook");
+        return insertBook(Book(book));
+    }
+
+    // Add a book by moving it into the library
+    bool addBook(Book &&book) {
+        LIBRARY_TRACE("addBook");
+        return insertBook(std::move(book));
+    }
+
+    // Add many books at once, reserving space up front; returns one status per book
+    vector<ItemStatus> addBooks(vector<Book> batch) {
+        LIBRARY_TRACE("addBooks");
+        size_t total = books.size() + batch.size();
+        books.reserve(total);
+        yearColumn.reserve(total);
+        priceColumn.reserve(total);
+        bookIds.reserve(total);
+        idPositions.reserve(idPositions.size() + batch.size());
+        idSlots.reserve(idSlots.size() + batch.size());
+        isbnIndex.reserve(total);
+
+        vector<ItemStatus> status;
+        status.reserve(batch.size());
+        for (auto &book : batch) {
+            status.push_back(insertBook(std::move(book)) ? ItemStatus::Ok : ItemStatus::DuplicateISBN);
+        }
+        return status;
+    }
+
+    // Remove many books by ISBN with one compaction pass; returns one status per ISBN
+    vector<ItemStatus> removeBooks(const vector<string> &isbns) {
+        LIBRARY_TRACE("removeBooks");
+        vector<char> doomed(books.size());
+        vector<ItemStatus> status;
+        status.reserve(isbns.size());
+        for (const auto &isbn : isbns) {
+            size_t pos = findPosition(isbn);
+            if (pos == npos || doomed[pos]) {
+                status.push_back(ItemStatus::NotFound);
+            } else {
+                doomed[pos] = 1;
+                status.push_back(ItemStatus::Ok);
+            }
+        }
+        eraseFlagged(doomed);
+        return status;
     }
 
     // Remove a book by ISBN
     void removeBook(const string &isbn) {
-        auto it = find_if(books.begin(), books.end(), [&](const Book &book) {
-            return book.isbn == isbn;
-        });
-
-        if (it != books.end()) {
-            books.erase(it);
+        LIBRARY_TRACE("removeBook");
+        if (eraseBook(isbn)) {
             cout << "Book removed successfully!" << endl;
         } else {
             cout << "Book not found!" << endl;
         }
     }
 
+    // Build (or drop) the trigram index used by searchByTitle and searchByAuthor.
+    // Search results are identical either way; only the cost per query changes.
+    void enableSubstringIndex(bool enabled = true) {
+        LIBRARY_TRACE("enableSubstringIndex");
+        titleGrams.clear();
+        authorGrams.clear();
+        substringIndexEnabled = enabled;
+        if (enabled) {
+            for (size_t i = 0; i < books.size(); ++i) {
+                titleGrams.add(bookIds[i], books[i].title);
+                authorGrams.add(bookIds[i], books[i].author);
+            }
+        }
+    }
+
+    // Build (or drop) the case-folded trigram indexes that let fuzzy searches
+    // skip books which cannot be within the edit bound
+    void enableFuzzyIndex(bool enabled = true) {
+        LIBRARY_TRACE("enableFuzzyIndex");
+        foldedTitleGrams.clear();
+        foldedAuthorGrams.clear();
+        fuzzyIndexEnabled = enabled;
+        if (enabled) {
+            for (size_t i = 0; i < books.size(); ++i) {
+                foldedTitleGrams.add(bookIds[i], books[i].title);
+                foldedAuthorGrams.add(bookIds[i], books[i].author);
+            }
+        }
+    }
+
+    // Books whose title contains the query with at most maxEdits typos,
+    // ignoring case, ranked best first; read them with bookAt
+    vector<FuzzyMatch> fuzzyFindByTitle(const string &title, size_t maxEdits = 2, size_t limit = 10) const {
+        LIBRARY_TRACE("fuzzyFindByTitle");
+        vector<FuzzyMatch> matches = fuzzyField(&Book::title, foldedTitleGrams, title, maxEdits, limit);
+        LIBRARY_RECORD(Returned, matches.size());
+        return matches;
+    }
+
+    // Books whose author contains the query with at most maxEdits typos, ranked like fuzzyFindByTitle
+    vector<FuzzyMatch> fuzzyFindByAuthor(const string &author, size_t maxEdits = 2, size_t limit = 10) const {
+        LIBRARY_TRACE("fuzzyFindByAuthor");
+        vector<FuzzyMatch> matches = fuzzyField(&Book::author, foldedAuthorGrams, author, maxEdits, limit);
+        LIBRARY_RECORD(Returned, matches.size());
+        return matches;
+    }
+
+    // Build (or drop) the prefix indexes behind completeTitle and completeAuthor
+    void enableAutocomplete(bool enabled = true) {
+        LIBRARY_TRACE("enableAutocomplete");
+        titlePrefixes.clear();
+        authorPrefixes.clear();
+        autocompleteEnabled = enabled;
+        if (enabled) {
+            vector<const string *> titles, authors;
+            titles.reserve(books.size());
+            authors.reserve(books.size());
+            for (const auto &book : books) {
+                titles.push_back(&book.title);
+                authors.push_back(&book.author);
+            }
+            titlePrefixes.addAll(titles);
+            authorPrefixes.addAll(authors);
+        }
+    }
+
+    // The n titles held by the most books among those with a word starting
+    // with prefix, ignoring case; empty unless enableAutocomplete was called
+    vector<Completion> completeTitle(const string &prefix, size_t n = 10) const {
+        LIBRARY_TRACE("completeTitle");
+        return titlePrefixes.complete(prefix, n);
+    }
+
+    // The n authors with the most books among those with a name part starting with prefix
+    vector<Completion> completeAuthor(const string &prefix, size_t n = 10) const {
+        LIBRARY_TRACE("completeAuthor");
+        return authorPrefixes.complete(prefix, n);
+    }
+
     // Search books by title
     vector<Book> searchByTitle(const string &title) const {
+        LIBRARY_TRACE("searchByTitle");
+        vector<Book> result = cachedSearch(QueryCache::Title, &Book::title, titleGrams, title);
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Search books by author
+    vector<Book> searchByAuthor(const string &author) const {
+        LIBRARY_TRACE("searchByAuthor");
+        vector<Book> result = cachedSearch(QueryCache::Author, &Book::author, authorGrams, author);
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Positions of the books whose title contains the query, skipping the first
+    // offset matches and returning at most limit; read them with bookAt
+    vector<size_t> findByTitle(const string &title, size_t offset = 0, size_t limit = npos) const {
+        LIBRARY_TRACE("findByTitle");
+        vector<size_t> page = pageField(&Book::title, titleGrams, title, offset, limit);
+        LIBRARY_RECORD(Returned, page.size());
+        return page;
+    }
+
+    // Positions of the books whose author contains the query, paged like findByTitle
+    vector<size_t> findByAuthor(const string &author, size_t offset = 0, size_t limit = npos) const {
+        LIBRARY_TRACE("findByAuthor");
+        vector<size_t> page = pageField(&Book::author, authorGrams, author, offset, limit);
+        LIBRARY_RECORD(Returned, page.size());
+        return page;
+    }
+
+    // Call visit(const Book &) for each book whose title contains the query
+    // until it returns false; no books are copied
+    template <typename Visit>
+    void forEachByTitle(const string &title, Visit visit) const {
+        LIBRARY_TRACE("forEachByTitle");
+        scanField(&Book::title, titleGrams, title, [&](size_t pos) {
+            LIBRARY_RECORD(Returned, 1);
+            return visit(books[pos]);
+        });
+    }
+
+    // Call visit(const Book &) for each book whose author contains the query
+    // until it returns false; no books are copied
+    template <typename Visit>
+    void forEachByAuthor(const string &author, Visit visit) const {
+        LIBRARY_TRACE("forEachByAuthor");
+        scanField(&Book::author, authorGrams, author, [&](size_t pos) {
+            LIBRARY_RECORD(Returned, 1);
+            return visit(books[pos]);
+        });
+    }
+
+    // Search books by ISBN (at most one match)
+    vector<Book> searchByISBN(const string &isbn) const {
+        LIBRARY_TRACE("searchByISBN");
         vector<Book> result;
-        for (const auto &book : books) {
-            if (book.title.find(title) != string::npos) {
-                result.push_back(book);
+        size_t pos = findPosition(isbn);
+        if (pos != npos) {
+            result.push_back(books[pos]);
+        }
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Cache up to capacity searchByTitle/searchByAuthor results so repeated
+    // queries skip the scan; any mutation invalidates the cache. 0 disables it.
+    void enableQueryCache(size_t capacity = 256) {
+        LIBRARY_TRACE("enableQueryCache");
+        queryCache.setCapacity(capacity);
+    }
+
+    // Hits, misses and evictions since the cache was enabled or stats were reset
+    QueryCacheStats queryCacheStats() const {
+        return queryCache.stats();
+    }
+
+    void resetQueryCacheStats() {
+        queryCache.resetStats();
+    }
+
+    // Maintain price, year, title and author orderings that survive inserts and
+    // removals, so ordered views cost nothing to switch between
+    void enableOrderedIndexes(bool enabled = true) {
+        LIBRARY_TRACE("enableOrderedIndexes");
+        priceOrder.clear();
+        yearOrder.clear();
+        titleOrder.clear();
+        authorOrder.clear();
+        orderedIndexesEnabled = enabled;
+        if (enabled) {
+            for (size_t i = 0; i < books.size(); ++i) {
+                priceOrder.add(books[i].price, bookIds[i]);
+                yearOrder.add(books[i].year, bookIds[i]);
+                titleOrder.add(books[i].title, bookIds[i]);
+                authorOrder.add(books[i].author, bookIds[i]);
+            }
+        }
+    }
+
+    // Maintain per-author and per-year price statistics and a price histogram
+    // (bucketCount buckets of bucketWidth) through every mutation
+    void enableAggregates(bool enabled = true, double bucketWidth = 10.0, size_t bucketCount = 32) {
+        LIBRARY_TRACE("enableAggregates");
+        aggregatesEnabled = enabled;
+        aggregates = CatalogAggregates(bucketWidth, bucketCount);
+        if (enabled) {
+            for (size_t i = 0; i < books.size(); ++i) {
+                aggregates.add(books[i], bookIds[i]);
+            }
+        }
+    }
+
+    // The maintained statistics; empty unless enableAggregates was called
+    const CatalogAggregates &catalogAggregates() const {
+        return aggregates;
+    }
+
+    // Recompute the statistics from scratch on a worker pool, using the
+    // enabled histogram layout
+    CatalogAggregates recomputeAggregates(size_t threads = 0) const {
+        LIBRARY_TRACE("recomputeAggregates");
+        LIBRARY_RECORD(Scanned, books.size());
+        return CatalogAggregates::compute(books, aggregates.histogramBucketWidth(),
+                                          aggregates.priceHistogram().size(), threads);
+    }
+
+    // True if the maintained statistics match a full parallel recompute
+    bool verifyAggregates(size_t threads = 0) const {
+        LIBRARY_TRACE("verifyAggregates");
+        return aggregates.matches(recomputeAggregates(threads));
+    }
+
+    // Visit books ordered by key (ties in insertion order, also when descending)
+    // until visit returns false.
+    // Uses the ordered indexes when enabled and sorts positions otherwise;
+    // storage order is never changed.
+    template <typename Visit>
+    void forEachOrdered(SortKey key, Visit visit, bool descending = false) const {
+        LIBRARY_TRACE("forEachOrdered");
+        switch (key) {
+        case SortKey::Price:
+            orderedIndexesEnabled ? visitIndex(priceOrder, descending, visit)
+                                  : visitSorted(&Book::price, descending, visit);
+            break;
+        case SortKey::Year:
+            orderedIndexesEnabled ? visitIndex(yearOrder, descending, visit)
+                                  : visitSorted(&Book::year, descending, visit);
+            break;
+        case SortKey::Title:
+            orderedIndexesEnabled ? visitIndex(titleOrder, descending, visit)
+                                  : visitSorted(&Book::title, descending, visit);
+            break;
+        case SortKey::Author:
+            orderedIndexesEnabled ? visitIndex(authorOrder, descending, visit)
+                                  : visitSorted(&Book::author, descending, visit);
+            break;
+        }
+    }
+
+    // First k books in key order, e.g. topK(SortKey::Price, 10) for the ten
+    // cheapest or topK(SortKey::Year, 10, true) for the ten newest
+    vector<Book> topK(SortKey key, size_t k, bool descending = false) const {
+        LIBRARY_TRACE("topK");
+        vector<Book> result;
+        if (k == 0) {
+            return result;
+        }
+        forEachOrdered(key, [&](const Book &book) {
+            result.push_back(book);
+            return result.size() < k;
+        }, descending);
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Books with lo <= price <= hi, ordered by price
+    vector<Book> rangeByPrice(double lo, double hi) const {
+        LIBRARY_TRACE("rangeByPrice");
+        vector<Book> result = orderedRange(priceOrder, &Book::price, lo, hi);
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Books with from <= year <= to, ordered by year
+    vector<Book> rangeByYear(int from, int to) const {
+        LIBRARY_TRACE("rangeByYear");
+        vector<Book> result = orderedRange(yearOrder, &Book::year, from, to);
+        LIBRARY_RECORD(Returned, result.size());
+        return result;
+    }
+
+    // Number of books in the library
+    size_t size() const {
+        return books.size();
+    }
+
+    // Visit the books matching query, honouring its ordering and limit, until
+    // visit(const Book &) returns false. Candidates come from the plan chosen
+    // by planQuery; unordered queries stream in catalog order and stop as soon
+    // as the limit is reached.
+    template <typename Visit>
+    void forEachWhere(const Query &query, Visit visit) const {
+        LIBRARY_TRACE("forEachWhere");
+        size_t limit = query.maxResults;
+        if (limit == 0) {
+            return;
+        }
+        AccessPath path = planQuery(query);
+        size_t emitted = 0, examined = 0;
+        auto emit = [&](const Book &book) {
+            ++examined;
+            if (!query.matches(book)) {
+                return true;
+            }
+            ++emitted;
+            return visit(book) && emitted < limit;
+        };
+
+        if (!query.ordered) {
+            if (path.scan) {
+                for (size_t pos = 0; pos < books.size() && emit(books[pos]); ++pos) {
+                }
+            } else {
+                for (size_t i = 0; i < path.positions.size() && emit(books[path.positions[i]]); ++i) {
+                }
+            }
+        } else if (path.scan && orderedIndexesEnabled) {
+            // Walking the ordered index lets a limited query stop early
+            forEachOrdered(query.orderKey, emit, query.descending);
+        } else {
+            vector<size_t> matches;
+            auto keep = [&](size_t pos) {
+                ++examined;
+                if (query.matches(books[pos])) {
+                    matches.push_back(pos);
+                }
+            };
+            if (path.scan) {
+                for (size_t pos = 0; pos < books.size(); ++pos) {
+                    keep(pos);
+                }
+            } else {
+                for (size_t pos : path.positions) {
+                    keep(pos);
+                }
             }
+            auto before = [&](size_t a, size_t b) {
+                const Book &x = books[a], &y = books[b];
+                bool ahead = false, behind = false;
+                switch (query.orderKey) {
+                case SortKey::Price: ahead = x.price < y.price; behind = y.price < x.price; break;
+                case SortKey::Year: ahead = x.year < y.year; behind = y.year < x.year; break;
+                case SortKey::Title: ahead = x.title < y.title; behind = y.title < x.title; break;
+                case SortKey::Author: ahead = x.author < y.author; behind = y.author < x.author; break;
+                }
+                if (query.descending) {
+                    swap(ahead, behind);
+                }
+                return ahead || (!behind && bookIds[a] < bookIds[b]);
+            };
+            size_t top = min(limit, matches.size());
+            partial_sort(matches.begin(), matches.begin() + top, matches.end(), before);
+            for (size_t i = 0; i < top && visit(books[matches[i]]); ++i) {
+            }
+            emitted = top;
+        }
+        LIBRARY_RECORD(Scanned, examined);
+        LIBRARY_RECORD(Returned, emitted);
+    }
+
+    // Positions of the books matching query, in the order forEachWhere visits them
+    vector<size_t> findWhere(const Query &query) const {
+        vector<size_t> positions;
+        forEachWhere(query, [&](const Book &book) {
+            positions.push_back(static_cast<size_t>(&book - books.data()));
+            return true;
+        });
+        return positions;
+    }
+
+    // How forEachWhere would run query: access path, filter, ordering and limit
+    string explain(const Query &query) const {
+        AccessPath path = planQuery(query);
+        ostringstream out;
+        out << "access: " << path.description;
+        if (!path.scan) {
+            out << " (" << path.positions.size() << " candidates)";
+        }
+        out << "; filter: " << query.describe();
+        if (query.ordered) {
+            static const char *keys[] = {"price", "year", "title", "author"};
+            out << "; order: " << keys[static_cast<int>(query.orderKey)] << (query.descending ? " desc" : " asc");
+            out << (path.scan && orderedIndexesEnabled ? " via ordered index" : " via sort");
+        }
+        if (query.maxResults != static_cast<size_t>(-1)) {
+            out << "; limit: " << query.maxResults;
+        }
+        return out.str();
+    }
+
+    // Book at a position returned by the range queries
+    const Book &bookAt(size_t pos) const {
+        return books[pos];
+    }
+
+    // Stable handle to the book at a position
+    BookHandle handleAt(size_t pos) const {
+        uint32_t slot = idSlots[bookIds[pos]];
+        return {slot, slots[slot].generation};
+    }
+
+    // Stable handle to the book with the given ISBN, or a null handle
+    BookHandle handleOf(const string &isbn) const {
+        size_t pos = findPosition(isbn);
+        return pos == npos ? BookHandle() : handleAt(pos);
+    }
+
+    // The book a handle refers to, or nullptr once it has been removed. The
+    // pointer is only valid until the next mutation; the handle stays valid.
+    const Book *bookFor(BookHandle handle) const {
+        size_t pos = handlePosition(handle);
+        return pos == npos ? nullptr : &books[pos];
+    }
+
+    // Current position of the book a handle refers to, or npos
+    size_t positionOf(BookHandle handle) const {
+        return handlePosition(handle);
+    }
+
+    // Remove a book by moving the last book into its position. Storage order
+    // changes (use removeBook(isbn) to preserve it); handles to every other
+    // book stay valid. False if the handle is stale. This is O(1) only while
+    // the secondary indexes are off: trigram postings are erased from sorted
+    // vectors, ordered indexes cost O(log n), and aggregates rescan a group
+    // when its minimum or maximum price is removed.
+    bool removeBook(BookHandle handle) {
+        LIBRARY_TRACE("removeBookByHandle");
+        size_t pos = handlePosition(handle);
+        if (pos == npos) {
+            return false;
+        }
+        queryCache.invalidate();
+        unindexSecondary(pos);
+        isbnIndex.erase(books[pos].isbn);
+        idPositions[bookIds[pos]] = npos;
+        releaseSlot(bookIds[pos]);
+        Book removed = std::move(books[pos]);
+
+        size_t last = books.size() - 1;
+        if (pos != last) {
+            books[pos] = std::move(books[last]);
+            yearColumn[pos] = yearColumn[last];
+            priceColumn[pos] = priceColumn[last];
+            bookIds[pos] = bookIds[last];
+            idPositions[bookIds[pos]] = pos;
+        }
+        books.pop_back();
+        yearColumn.pop_back();
+        priceColumn.pop_back();
+        bookIds.pop_back();
+        logMutation(Journal::Remove, removed);
+        return true;
+    }
+
+    // Drop freed slots from the end of the handle table, reuse the lowest
+    // free slots first and return spare capacity. Stale handles stay stale.
+    void compact() {
+        LIBRARY_TRACE("compact");
+        while (!slots.empty() && slots.back().id == freeSlot) {
+            generationFloor = max(generationFloor, slots.back().generation);
+            slots.pop_back();
+        }
+        freeSlots.erase(remove_if(freeSlots.begin(), freeSlots.end(),
+                                  [&](uint32_t slot) { return slot >= slots.size(); }),
+                        freeSlots.end());
+        sort(freeSlots.begin(), freeSlots.end(), greater<uint32_t>());
+        books.shrink_to_fit();
+        yearColumn.shrink_to_fit();
+        priceColumn.shrink_to_fit();
+        bookIds.shrink_to_fit();
+        slots.shrink_to_fit();
+        freeSlots.shrink_to_fit();
+    }
+
+    // Positions of books with lo <= price <= hi, ascending
+    vector<size_t> findByPriceRange(double lo, double hi) const {
+        LIBRARY_TRACE("findByPriceRange");
+        vector<uint64_t> mask((books.size() + 63) / 64);
+        rangeMask(priceColumn.data(), priceColumn.size(), lo, hi, mask.data());
+        vector<size_t> positions = maskPositions(mask);
+        LIBRARY_RECORD(Scanned, books.size());
+        LIBRARY_RECORD(Returned, positions.size());
+        return positions;
+    }
+
+    // Positions of books with from <= year <= to, ascending
+    vector<size_t> findByYearRange(int from, int to) const {
+        LIBRARY_TRACE("findByYearRange");
+        vector<uint64_t> mask((books.size() + 63) / 64);
+        rangeMask(yearColumn.data(), yearColumn.size(), from, to, mask.data());
+        vector<size_t> positions = maskPositions(mask);
+        LIBRARY_RECORD(Scanned, books.size());
+        LIBRARY_RECORD(Returned, positions.size());
+        return positions;
+    }
+
+    // Positions of books matching both a price and a year range, ascending
+    vector<size_t> findByPriceAndYearRange(double lo, double hi, int from, int to) const {
+        LIBRARY_TRACE("findByPriceAndYearRange");
+        vector<uint64_t> priceMask((books.size() + 63) / 64);
+        vector<uint64_t> yearMask(priceMask.size());
+        rangeMask(priceColumn.data(), priceColumn.size(), lo, hi, priceMask.data());
+        rangeMask(yearColumn.data(), yearColumn.size(), from, to, yearMask.data());
+        for (size_t w = 0; w < priceMask.size(); ++w) {
+            priceMask[w] &= yearMask[w];
         }
-        return result;
+        vector<size_t> positions = maskPositions(priceMask);
+        LIBRARY_RECORD(Scanned, books.size());
+        LIBRARY_RECORD(Returned, positions.size());
+        return positions;
     }
 
-    // Search books by author
-    vector<Book> searchByAuthor(const string &author) const {
-        vector<Book> result;
-        for (const auto &book : books) {
-            if (book.author.find(author) != string::npos) {
-                result.push_back(book);
-            }
+    // ISBNs of the books at the given positions
+    vector<string> isbnsAt(const vector<size_t> &positions) const {
+        vector<string> isbns;
+        isbns.reserve(positions.size());
+        for (size_t pos : positions) {
+            isbns.push_back(books[pos].isbn);
         }
-        return result;
+        return isbns;
     }
 
-    // Sort books by price (ascending)
-    void sortByPrice() {
-        sort(books.begin(), books.end(), [](const Book &a, const Book &b) {
-            return a.price < b.price;
+    // Sort books by price (ascending); books with equal prices keep their
+    // relative order. threads only applies to ParallelRadix (0 = all cores).
+    void sortByPrice(SortAlgorithm algorithm = SortAlgorithm::Auto, size_t threads = 0) {
+        LIBRARY_TRACE("sortByPrice");
+        sortBooks<uint64_t>(algorithm, threads, [this](size_t pos) {
+            return sortablePriceKey(priceColumn[pos]);
         });
     }
 
-    // Sort books by year (ascending)
-    void sortByYear() {
-        sort(books.begin(), books.end(), [](const Book &a, const Book &b) {
-            return a.year < b.year;
+    // Sort books by year (ascending), stable like sortByPrice
+    void sortByYear(SortAlgorithm algorithm = SortAlgorithm::Auto, size_t threads = 0) {
+        LIBRARY_TRACE("sortByYear");
+        sortBooks<uint32_t>(algorithm, threads, [this](size_t pos) {
+            return sortableYearKey(yearColumn[pos]);
         });
     }
 
     // Display all books
     void displayAllBooks() const {
-        cout << left << setw(20) << "Title"
-             << setw(20) << "Author"
-             << setw(15) << "ISBN"
-             << setw(10) << "Year"
-             << setw(10) << "Price" << endl;
+        LIBRARY_TRACE("displayAllBooks");
+        BufferedWriter out(cout);
+        writeBookTable(out, books);
+    }
 
-        for (const auto &book : books) {
-            book.display();
-        }
+    // Write the displayAllBooks table straight to a file descriptor;
+    // returns false if a write failed
+    bool renderAllBooks(int fd) const {
+        LIBRARY_TRACE("renderAllBooks");
+        cout.flush(); // Keep earlier cout output ahead of ours when fd is stdout
+        BufferedWriter out(fd);
+        writeBookTable(out, books);
+        return out.flush();
     }
 
-    // Load books from a file
-    void loadBooksFromFile(const string &filename) {
-        ifstream file(filename);
-        if (!file.is_open()) {
+    // Stream the catalog to a file descriptor as CSV with a header line
+    bool exportCsv(int fd) const {
+        LIBRARY_TRACE("exportCsv");
+        BufferedWriter out(fd);
+        writeBooksCsv(out, books);
+        return out.flush();
+    }
+
+    // Stream the catalog to a file descriptor as one JSON object per line
+    bool exportJsonLines(int fd) const {
+        LIBRARY_TRACE("exportJsonLines");
+        BufferedWriter out(fd);
+        writeBooksJsonLines(out, books);
+        return out.flush();
+    }
+
+    // Load books from a file.
+    // The file is read in large blocks cut on record boundaries; the blocks are
+    // parsed on a worker pool and merged back in file order. Malformed records
+    // and duplicate ISBNs are skipped and reported with their line numbers.
+    // If a journal written by enableJournal sits next to the file, its records
+    // are replayed on top of the snapshot.
+    LoadReport loadBooksFromFile(const string &filename, size_t threads = 0,
+                                 size_t blockSize = defaultLoadBlockSize) {
+        LIBRARY_TRACE("loadBooksFromFile");
+        LoadReport report;
+        string journalPath = filename + ".journal";
+        ifstream file(filename, ios::binary);
+        if (!file.is_open() && access(journalPath.c_str(), F_OK) != 0) {
             cout << "Error opening file for reading!" << endl;
-            return;
+            return report;
         }
 
-        while (!file.eof()) {
-            books.push_back(Book::loadFromFile(file));
+        if (file.is_open()) {
+            loadTextCatalog(file, report, threads, blockSize);
         }
-        file.close();
+        replayJournal(journalPath, report);
+        stable_sort(report.errors.begin(), report.errors.end(), [](const LoadError &a, const LoadError &b) {
+            return a.line < b.line;
+        });
+        return report;
     }
 
-    // Save books to a file
-    void saveBooksToFile(const string &filename) const {
+    // Save books to a file; returns false if it could not be written.
+    // Saving over the snapshot of an enabled journal checkpoints instead: the
+    // snapshot is replaced atomically and the journal emptied, so its records
+    // are not replayed a second time on top of the new snapshot.
+    bool saveBooksToFile(const string &filename) const {
+        LIBRARY_TRACE("saveBooksToFile");
+        if (journal && filename == journalSnapshot) {
+            if (!journal->flush() || !writeSnapshot(filename) || !journal->truncate()) {
+                cout << "Error writing journal checkpoint!" << endl;
+                return false;
+            }
+            return true;
+        }
         ofstream file(filename);
         if (!file.is_open()) {
             cout << "Error opening file for writing!" << endl;
-            return;
+            return false;
         }
 
         for (const auto &book : books) {
             book.saveToFile(file);
         }
+        LIBRARY_RECORD(BytesWritten, static_cast<uint64_t>(file.tellp()));
         file.close();
+        return !file.fail();
+    }
+
+    // Write the catalog with writeCatalogAtomically on the calling thread
+    SaveResult saveSnapshot(const string &filename) const {
+        LIBRARY_TRACE("saveSnapshot");
+        return writeCatalogAtomically(filename, books);
+    }
+
+    // Save a point-in-time copy of the catalog on a background thread. The
+    // library can be mutated as soon as this returns, but the books are
+    // deep-copied on the caller's thread first, which is O(n) in time and
+    // memory. ConcurrentLibrary::saveBooksToFileAsync shares an immutable
+    // snapshot instead and does not block the caller. The file is replaced
+    // atomically. Destroying the returned future waits for the save to finish.
+    future<SaveResult> saveBooksToFileAsync(const string &filename,
+                                            function<void(const SaveResult &)> onDone = nullptr) const {
+        LIBRARY_TRACE("saveBooksToFileAsync");
+        auto copy = make_shared<const vector<Book>>(books);
+        return runSaveInBackground([copy, filename] { return writeCatalogAtomically(filename, *copy); },
+                                   std::move(onDone));
+    }
+
+    // Load books from a binary catalog written by saveBooksToBinaryFile
+    bool loadBooksFromBinaryFile(const string &filename) {
+        LIBRARY_TRACE("loadBooksFromBinaryFile");
+        BinaryCatalog catalog;
+        if (!catalog.open(filename)) {
+            cout << "Error opening binary catalog for reading!" << endl;
+            return false;
+        }
+
+        books.reserve(books.size() + catalog.size());
+        for (size_t i = 0; i < catalog.size(); ++i) {
+            insertBook(catalog.bookAt(i));
+        }
+        return true;
+    }
+
+    // Save books as a binary catalog that BinaryCatalog can map directly
+    bool saveBooksToBinaryFile(const string &filename) const {
+        LIBRARY_TRACE("saveBooksToBinaryFile");
+        if (!BinaryCatalog::write(filename, books)) {
+            cout << "Error opening file for writing!" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Heap bytes and allocations held by the books and the ISBN index, the
+    // parts CompactCatalog replaces (optional secondary indexes are excluded)
+    MemoryUsage bookMemoryUsage() const {
+        MemoryUsage usage = isbnIndex.memoryUsage();
+        usage.bytes += books.capacity() * sizeof(Book);
+        usage.allocations += 1;
+        const size_t inlineCapacity = string().capacity();
+        auto addString = [&](const string &text) {
+            if (text.capacity() > inlineCapacity) {
+                usage.bytes += text.capacity() + 1;
+                ++usage.allocations;
+            }
+        };
+        for (const auto &book : books) {
+            addString(book.title);
+            addString(book.author);
+            addString(book.isbn);
+        }
+        return usage;
+    }
+
+    // Copy the books into an arena-backed CompactCatalog
+    CompactCatalog toCompactCatalog() const {
+        LIBRARY_TRACE("toCompactCatalog");
+        CompactCatalog compact;
+        for (const auto &book : books) {
+            compact.add(book);
+        }
+        return compact;
+    }
+
+    // Compare the memory held by the books with the arena-backed layout
+    void displayMemoryReport() const {
+        MemoryUsage current = bookMemoryUsage();
+        MemoryUsage compact = toCompactCatalog().memoryUsage();
+        cout << left << setw(20) << "Layout" << setw(15) << "Bytes" << setw(15) << "Used bytes" << setw(15)
+             << "Allocations" << endl;
+        cout << setw(20) << "std::string" << setw(15) << current.bytes << setw(15)
+             << current.bytes - current.unusedBytes << setw(15) << current.allocations << endl;
+        cout << setw(20) << "arena + interned" << setw(15) << compact.bytes << setw(15)
+             << compact.bytes - compact.unusedBytes << setw(15) << compact.allocations << endl;
     }
 
-    // Display total number of books in the library
-    void displayTotalBooks() const {
+    // Display and return the total number of books in the library
+    size_t displayTotalBooks() const {
         cout << "Total books in the library: " << books.size() << endl;
+        return books.size();
     }
 
     // Clear all books from the library
     void clearBooks() {
-        books.clear();
+        LIBRARY_TRACE("clearBooks");
+        eraseAll();
         cout << "All books have been removed from the library!" << endl;
     }
 
 std::optional<Book> displayBookByISBN(const string &isbn) const {
-    auto it = find_if(books.begin(), books.end(), [&](const Book &book) {
-        return book.isbn == isbn;
-    });
+    LIBRARY_TRACE("displayBookByISBN");
+    size_t pos = findPosition(isbn);
 
-    if (it != books.end()) {
-        it->display();  // Still print the book details
-        return *it;     // Return the found book
+    if (pos != npos) {
+        books[pos].display();  // Still print the book details
+        return books[pos];     // Return the found book
     } else {
         cout << "Book not found!" << endl;
         return std::nullopt;  // Return an empty optional if not found
@@ -186,13 +4675,96 @@ std::optional<Book> displayBookByISBN(const string &isbn) const {
 
 
 
+    // Replace the title, author, year and price of the book with the same ISBN
+    bool updateBookDetails(const Book &book) {
+        LIBRARY_TRACE("updateBookDetails");
+        size_t pos = findPosition(book.isbn);
+        if (pos == npos) {
+            return false;
+        }
+        queryCache.invalidate();
+        unindexSecondary(pos);
+        // The stored ISBN keeps its original spelling; only the details change
+        books[pos].title = book.title;
+        books[pos].author = book.author;
+        books[pos].year = book.year;
+        books[pos].price = book.price;
+        yearColumn[pos] = book.year;
+        priceColumn[pos] = book.price;
+        indexSecondary(pos);
+        logMutation(Journal::Update, books[pos]);
+        return true;
+    }
+
+    // Start logging mutations to snapshotFile + ".journal" instead of rewriting
+    // the snapshot on every save. The library should hold what the snapshot and
+    // its journal describe (e.g. right after loadBooksFromFile(snapshotFile));
+    // a missing snapshot is written first. Records are fsynced every batchSize
+    // operations and folded into the snapshot once the journal reaches compactBytes.
+    bool enableJournal(const string &snapshotFile, size_t batchSize = 64,
+                       uint64_t compactBytes = 64 << 20) {
+        LIBRARY_TRACE("enableJournal");
+        if (access(snapshotFile.c_str(), F_OK) != 0 && !writeSnapshot(snapshotFile)) {
+            cout << "Error opening file for writing!" << endl;
+            return false;
+        }
+        auto opened = make_unique<Journal>(batchSize);
+        if (!opened->open(snapshotFile + ".journal")) {
+            cout << "Error opening journal for writing!" << endl;
+            return false;
+        }
+        journal = std::move(opened);
+        journalSnapshot = snapshotFile;
+        journalCompactBytes = compactBytes;
+        journalFailed = false;
+        return true;
+    }
+
+    // Flush pending journal records and stop journaling
+    void disableJournal() {
+        journal.reset();
+        journalSnapshot.clear();
+    }
+
+    // Force buffered journal records to disk
+    bool syncJournal() {
+        LIBRARY_TRACE("syncJournal");
+        if (journal && !journal->flush()) {
+            journalFailure();
+            return false;
+        }
+        return true;
+    }
+
+    // Write a fresh snapshot and empty the journal
+    bool compactJournal() {
+        LIBRARY_TRACE("compactJournal");
+        if (!journal) {
+            return false;
+        }
+        if (!journal->flush() || !writeSnapshot(journalSnapshot)) {
+            return false;
+        }
+        return journal->truncate();
+    }
+
+    // False once a journal write, fsync or compaction has failed since
+    // enableJournal; mutations after that may not survive a crash
+    bool journalHealthy() const {
+        return !journalFailed;
+    }
+
+    // Size of the journal in bytes, including unflushed records
+    uint64_t journalSize() const {
+        return journal ? journal->size() : 0;
+    }
+
     // Update book details
     void updateBookDetails(const string &isbn) {
-        auto it = find_if(books.begin(), books.end(), [&](const Book &book) {
-            return book.isbn == isbn;
-        });
+        size_t pos = findPosition(isbn);
 
-        if (it != books.end()) {
+        if (pos != npos) {
+            auto it = books.begin() + pos;
             string newTitle, newAuthor;
             int newYear;
             double newPrice;
@@ -210,10 +4782,7 @@ std::optional<Book> displayBookByISBN(const string &isbn) const {
             cout << "Enter new price (current: " << it->price << "): ";
             cin >> newPrice;
 
-            it->title = newTitle;
-            it->author = newAuthor;
-            it->year = newYear;
-            it->price = newPrice;
+            updateBookDetails(Book(newTitle, newAuthor, isbn, newYear, newPrice));
 
             cout << "Book details updated successfully!" << endl;
         } else {
@@ -222,6 +4791,316 @@ std::optional<Book> displayBookByISBN(const string &isbn) const {
     }
 };
 
+// Library served to many reader threads while writers publish new versions.
+// Readers take an immutable snapshot (a shared_ptr to a const Library) and
+// query it without locks; a writer applies a whole batch of mutations to a
+// private copy of the newest version and swaps it in atomically. Old
+// snapshots stay valid until their last reader drops them. Each publish
+// copies the catalog, so writers should batch their mutations.
+class ConcurrentLibrary {
+private:
+    shared_ptr<const Library> current;
+    mutex writerMutex;
+
+public:
+    explicit ConcurrentLibrary(Library initial = Library())
+        : current(make_shared<const Library>(std::move(initial))) {}
+
+    // The newest published version
+    shared_ptr<const Library> snapshot() const {
+        return atomic_load(&current);
+    }
+
+    // Apply mutate(Library &) to a copy of the newest version and publish it.
+    // Writers are serialized; readers are never blocked.
+    template <typename Mutate>
+    void update(Mutate mutate) {
+        lock_guard<mutex> lock(writerMutex);
+        auto next = make_shared<Library>(*atomic_load(&current));
+        mutate(*next);
+        atomic_store(&current, shared_ptr<const Library>(std::move(next)));
+    }
+
+    // Search books by title in the newest version
+    vector<Book> searchByTitle(const string &title) const {
+        return snapshot()->searchByTitle(title);
+    }
+
+    // Search books by author in the newest version
+    vector<Book> searchByAuthor(const string &author) const {
+        return snapshot()->searchByAuthor(author);
+    }
+
+    // Display a book by ISBN from the newest version
+    std::optional<Book> displayBookByISBN(const string &isbn) const {
+        return snapshot()->displayBookByISBN(isbn);
+    }
+
+    // Save the newest version on a background thread. The snapshot is shared,
+    // not copied, so neither readers nor writers wait for the save.
+    future<SaveResult> saveBooksToFileAsync(const string &filename,
+                                            function<void(const SaveResult &)> onDone = nullptr) const {
+        shared_ptr<const Library> version = snapshot();
+        return runSaveInBackground([version, filename] { return version->saveSnapshot(filename); },
+                                   std::move(onDone));
+    }
+
+    // Look up a book by ISBN in the newest version without printing
+    std::optional<Book> findByISBN(const string &isbn) const {
+        auto books = snapshot()->searchByISBN(isbn);
+        if (books.empty()) {
+            return std::nullopt;
+        }
+        return books[0];
+    }
+};
+
+// Library split into shards by ISBN hash. Point operations go to the owning
+// shard; scans run on every shard at once on a worker pool and their results
+// are concatenated in shard order, or merged by key for ordered queries.
+// Mutations must not run concurrently with other calls.
+class ShardedLibrary {
+private:
+    vector<Library> shards;
+    mutable ThreadPool pool;
+
+    size_t shardOf(const string &isbn) const {
+        // Shard valid ISBNs by key so every formatting lands on the same shard
+        if (auto key = IsbnKey::parse(isbn)) {
+            return hash<IsbnKey>()(*key) % shards.size();
+        }
+        return hash<string>()(isbn) % shards.size();
+    }
+
+    // Run query(const Library &) on every shard in parallel; results in shard order
+    template <typename Query>
+    auto fanOut(Query query) const -> vector<decltype(query(shards[0]))> {
+        using Result = decltype(query(shards[0]));
+        vector<future<Result>> pending;
+        pending.reserve(shards.size());
+        for (const Library &shard : shards) {
+            pending.push_back(pool.submit([&query, &shard] { return query(shard); }));
+        }
+        vector<Result> results;
+        results.reserve(shards.size());
+        for (auto &result : pending) {
+            results.push_back(result.get());
+        }
+        return results;
+    }
+
+    static vector<Book> concatenate(vector<vector<Book>> parts) {
+        size_t total = 0;
+        for (const auto &part : parts) {
+            total += part.size();
+        }
+        vector<Book> result;
+        result.reserve(total);
+        for (auto &part : parts) {
+            std::move(part.begin(), part.end(), back_inserter(result));
+        }
+        return result;
+    }
+
+    // k-way merge of runs already ordered by before; equal books keep shard order
+    template <typename Before>
+    static vector<Book> mergeRuns(vector<vector<Book>> runs, Before before, size_t limit) {
+        using Head = pair<size_t, size_t>; // (run, index)
+        auto later = [&](const Head &a, const Head &b) {
+            const Book &x = runs[a.first][a.second], &y = runs[b.first][b.second];
+            return before(y, x) || (!before(x, y) && b.first < a.first);
+        };
+        priority_queue<Head, vector<Head>, decltype(later)> heads(later);
+        for (size_t r = 0; r < runs.size(); ++r) {
+            if (!runs[r].empty()) {
+                heads.push({r, 0});
+            }
+        }
+        vector<Book> result;
+        while (!heads.empty() && result.size() < limit) {
+            Head head = heads.top();
+            heads.pop();
+            result.push_back(std::move(runs[head.first][head.second]));
+            if (head.second + 1 < runs[head.first].size()) {
+                heads.push({head.first, head.second + 1});
+            }
+        }
+        return result;
+    }
+
+    template <typename Key>
+    static vector<Book> mergeBy(vector<vector<Book>> runs, Key Book::*field, bool descending, size_t limit) {
+        return mergeRuns(std::move(runs), [field, descending](const Book &a, const Book &b) {
+            return descending ? b.*field < a.*field : a.*field < b.*field;
+        }, limit);
+    }
+
+public:
+    // shardCount and threads default to the number of hardware threads
+    explicit ShardedLibrary(size_t shardCount = 0, size_t threads = 0)
+        : shards(max<size_t>(1, shardCount ? shardCount : thread::hardware_concurrency())), pool(threads) {}
+
+    size_t shardCount() const {
+        return shards.size();
+    }
+
+    const Library &shard(size_t i) const {
+        return shards[i];
+    }
+
+    // Number of books across all shards
+    size_t size() const {
+        size_t total = 0;
+        for (const Library &shard : shards) {
+            total += shard.size();
+        }
+        return total;
+    }
+
+    // Add a book to its shard; returns false if the ISBN is already present
+    bool addBook(Book book) {
+        size_t owner = shardOf(book.isbn);
+        return shards[owner].addBook(std::move(book));
+    }
+
+    // Add many books, filling the shards in parallel; one status per book
+    vector<ItemStatus> addBooks(vector<Book> batch) {
+        vector<vector<Book>> parts(shards.size());
+        vector<size_t> owners(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            owners[i] = shardOf(batch[i].isbn);
+            parts[owners[i]].push_back(std::move(batch[i]));
+        }
+        vector<future<vector<ItemStatus>>> pending;
+        for (size_t s = 0; s < shards.size(); ++s) {
+            pending.push_back(pool.submit([this, s, &parts] { return shards[s].addBooks(std::move(parts[s])); }));
+        }
+        vector<vector<ItemStatus>> perShard;
+        for (auto &part : pending) {
+            perShard.push_back(part.get());
+        }
+        vector<ItemStatus> status(owners.size());
+        vector<size_t> next(shards.size());
+        for (size_t i = 0; i < owners.size(); ++i) {
+            status[i] = perShard[owners[i]][next[owners[i]]++];
+        }
+        return status;
+    }
+
+    // Remove a book by ISBN; returns false if it was not found
+    bool removeBook(const string &isbn) {
+        return shards[shardOf(isbn)].removeBooks({isbn})[0] == ItemStatus::Ok;
+    }
+
+    // Replace the details of the book with the same ISBN
+    bool updateBookDetails(const Book &book) {
+        return shards[shardOf(book.isbn)].updateBookDetails(book);
+    }
+
+    // Look up a book by ISBN in its shard
+    std::optional<Book> findByISBN(const string &isbn) const {
+        vector<Book> found = shards[shardOf(isbn)].searchByISBN(isbn);
+        if (found.empty()) {
+            return std::nullopt;
+        }
+        return found[0];
+    }
+
+    // Run mutate(Library &) on every shard in parallel
+    template <typename Mutate>
+    void fanOutMutable(Mutate mutate) {
+        vector<future<void>> pending;
+        for (Library &shard : shards) {
+            pending.push_back(pool.submit([&mutate, &shard] { mutate(shard); }));
+        }
+        for (auto &done : pending) {
+            done.get();
+        }
+    }
+
+    // Build (or drop) the trigram index on every shard
+    void enableSubstringIndex(bool enabled = true) {
+        fanOutMutable([enabled](Library &shard) { shard.enableSubstringIndex(enabled); });
+    }
+
+    // Build (or drop) the ordered indexes on every shard
+    void enableOrderedIndexes(bool enabled = true) {
+        fanOutMutable([enabled](Library &shard) { shard.enableOrderedIndexes(enabled); });
+    }
+
+    // Books whose title contains the query, grouped by shard
+    vector<Book> searchByTitle(const string &title) const {
+        return concatenate(fanOut([&title](const Library &shard) { return shard.searchByTitle(title); }));
+    }
+
+    // Books whose author contains the query, grouped by shard
+    vector<Book> searchByAuthor(const string &author) const {
+        return concatenate(fanOut([&author](const Library &shard) { return shard.searchByAuthor(author); }));
+    }
+
+    // Books with lo <= price <= hi, ordered by price
+    vector<Book> rangeByPrice(double lo, double hi) const {
+        return mergeBy(fanOut([lo, hi](const Library &shard) { return shard.rangeByPrice(lo, hi); }),
+                       &Book::price, false, Library::npos);
+    }
+
+    // Books with from <= year <= to, ordered by year
+    vector<Book> rangeByYear(int from, int to) const {
+        return mergeBy(fanOut([from, to](const Library &shard) { return shard.rangeByYear(from, to); }),
+                       &Book::year, false, Library::npos);
+    }
+
+    // First k books in key order across all shards
+    vector<Book> topK(SortKey key, size_t k, bool descending = false) const {
+        auto runs = fanOut([key, k, descending](const Library &shard) { return shard.topK(key, k, descending); });
+        switch (key) {
+        case SortKey::Price:
+            return mergeBy(std::move(runs), &Book::price, descending, k);
+        case SortKey::Year:
+            return mergeBy(std::move(runs), &Book::year, descending, k);
+        case SortKey::Title:
+            return mergeBy(std::move(runs), &Book::title, descending, k);
+        case SortKey::Author:
+            return mergeBy(std::move(runs), &Book::author, descending, k);
+        }
+        return {};
+    }
+
+    // Every book ordered by price (ascending)
+    vector<Book> sortedByPrice() const {
+        return topK(SortKey::Price, Library::npos);
+    }
+
+    // Every book ordered by year (ascending)
+    vector<Book> sortedByYear() const {
+        return topK(SortKey::Year, Library::npos);
+    }
+};
+
+// Convert a text catalog to the binary catalog format
+bool convertTextToBinaryCatalog(const string &textFile, const string &binaryFile) {
+    Library library;
+    library.loadBooksFromFile(textFile);
+    return library.saveBooksToBinaryFile(binaryFile);
+}
+
+// Convert a binary catalog back to the text format
+bool convertBinaryToTextCatalog(const string &binaryFile, const string &textFile) {
+    BinaryCatalog catalog;
+    if (!catalog.open(binaryFile)) {
+        return false;
+    }
+    ofstream file(textFile);
+    if (!file.is_open()) {
+        return false;
+    }
+    for (size_t i = 0; i < catalog.size(); ++i) {
+        catalog.bookAt(i).saveToFile(file);
+    }
+    file.close();
+    return !file.fail();
+}
+
 // Display the main menu options
 void displayMenu() {
     cout << "\nLibrary Management System\n";
@@ -261,11 +5140,280 @@ int getValidIntegerInput() {
     return choice;
 }
 
-// Main function for library management
-int main() {
+// Batch mode: one command per line, fields separated by tabs, with \t, \n and
+// \\ escapes inside fields. Blank lines and lines starting with # are skipped.
+//   add <title> <author> <isbn> <year> <price>    update <title> <author> <isbn> <year> <price>
+//   remove <isbn>          get <isbn>             title <query>      author <query>
+//   sort price|year        load <file>            save <file>        list
+//   count                  clear
+// Every command answers with "ok" (plus values) or "error <line> <message>";
+// get, title, author and list first print one "book" line per match. A final
+// "done <commands> <errors>" line closes the run. Runs of consecutive removes
+// are applied with a single compaction pass.
+class BatchRunner {
+private:
+    Library &library;
+    BufferedWriter &out;
+    size_t commands = 0;
+    size_t failures = 0;
+    vector<pair<size_t, string>> pendingRemovals; // (line, isbn)
+
+    static string unescape(string_view text) {
+        string result;
+        result.reserve(text.size());
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '\\' && i + 1 < text.size()) {
+                char next = text[++i];
+                result += next == 't' ? '\t' : next == 'n' ? '\n' : next;
+            } else {
+                result += text[i];
+            }
+        }
+        return result;
+    }
+
+    void field(string_view text) {
+        out.write('\t');
+        size_t start = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const char *escaped = text[i] == '\t' ? "\\t" : text[i] == '\n' ? "\\n" : text[i] == '\\' ? "\\\\" : nullptr;
+            if (escaped) {
+                out.write(text.substr(start, i - start)).write(escaped);
+                start = i + 1;
+            }
+        }
+        out.write(text.substr(start));
+    }
+
+    void writeBook(const Book &book) {
+        out.write("book");
+        field(book.title);
+        field(book.author);
+        field(book.isbn);
+        out.write('\t').number(static_cast<long long>(book.year)).write('\t').number(book.price).write('\n');
+    }
+
+    void ok() {
+        out.write("ok\n");
+    }
+
+    void ok(size_t value) {
+        out.write("ok\t").number(static_cast<long long>(value)).write('\n');
+    }
+
+    void fail(size_t line, string_view message) {
+        ++failures;
+        out.write("error\t").number(static_cast<long long>(line));
+        field(message);
+        out.write('\n');
+    }
+
+    template <typename Number>
+    static bool parse(string_view text, Number &value) {
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+
+    bool parseBook(const vector<string_view> &args, size_t line, Book &book) {
+        if (args.size() != 6) {
+            fail(line, "expected title, author, isbn, year and price");
+            return false;
+        }
+        if (!parse(args[4], book.year)) {
+            fail(line, "invalid year '" + string(args[4]) + "'");
+            return false;
+        }
+        if (!parse(args[5], book.price) || !isfinite(book.price)) {
+            fail(line, "invalid price '" + string(args[5]) + "'");
+            return false;
+        }
+        book.title = unescape(args[1]);
+        book.author = unescape(args[2]);
+        book.isbn = unescape(args[3]);
+        return true;
+    }
+
+    void flushRemovals() {
+        if (pendingRemovals.empty()) {
+            return;
+        }
+        vector<string> isbns;
+        isbns.reserve(pendingRemovals.size());
+        for (const auto &removal : pendingRemovals) {
+            isbns.push_back(removal.second);
+        }
+        vector<ItemStatus> status = library.removeBooks(isbns);
+        for (size_t i = 0; i < status.size(); ++i) {
+            if (status[i] == ItemStatus::Ok) {
+                ok();
+            } else {
+                fail(pendingRemovals[i].first, "not found");
+            }
+        }
+        pendingRemovals.clear();
+    }
+
+    void execute(const vector<string_view> &args, size_t line) {
+        string_view command = args[0];
+        auto expect = [&](size_t count) {
+            if (args.size() != count) {
+                fail(line, string(command) + " takes " + to_string(count - 1) + " argument(s)");
+                return false;
+            }
+            return true;
+        };
+
+        if (command == "remove") {
+            if (expect(2)) {
+                pendingRemovals.emplace_back(line, unescape(args[1]));
+            }
+            return;
+        }
+        flushRemovals();
+
+        Book book;
+        if (command == "add") {
+            if (parseBook(args, line, book)) {
+                string isbn = book.isbn;
+                library.addBook(std::move(book)) ? ok() : fail(line, "duplicate ISBN '" + isbn + "'");
+            }
+        } else if (command == "update") {
+            if (parseBook(args, line, book)) {
+                library.updateBookDetails(book) ? ok() : fail(line, "not found");
+            }
+        } else if (command == "get") {
+            if (expect(2)) {
+                vector<Book> found = library.searchByISBN(unescape(args[1]));
+                for (const auto &match : found) {
+                    writeBook(match);
+                }
+                found.empty() ? fail(line, "not found") : ok(1);
+            }
+        } else if (command == "title" || command == "author") {
+            if (expect(2)) {
+                size_t count = 0;
+                auto visit = [&](const Book &match) {
+                    writeBook(match);
+                    ++count;
+                    return true;
+                };
+                string query = unescape(args[1]);
+                command == "title" ? library.forEachByTitle(query, visit) : library.forEachByAuthor(query, visit);
+                ok(count);
+            }
+        } else if (command == "sort") {
+            if (expect(2)) {
+                if (args[1] == "price") {
+                    library.sortByPrice();
+                    ok();
+                } else if (args[1] == "year") {
+                    library.sortByYear();
+                    ok();
+                } else {
+                    fail(line, "sort key must be price or year");
+                }
+            }
+        } else if (command == "load") {
+            if (expect(2)) {
+                string filename = unescape(args[1]);
+                if (access(filename.c_str(), F_OK) != 0 && access((filename + ".journal").c_str(), F_OK) != 0) {
+                    fail(line, "cannot open '" + filename + "'");
+                    return;
+                }
+                LoadReport report = library.loadBooksFromFile(filename);
+                for (const auto &error : report.errors) {
+                    out.write("warning\t").number(static_cast<long long>(error.line));
+                    field(error.message);
+                    out.write('\n');
+                }
+                ok(report.loaded + report.replayed);
+            }
+        } else if (command == "save") {
+            if (expect(2)) {
+                string filename = unescape(args[1]);
+                library.saveBooksToFile(filename) ? ok() : fail(line, "cannot write '" + filename + "'");
+            }
+        } else if (command == "list") {
+            if (expect(1)) {
+                size_t count = 0;
+                for (size_t pos = 0; pos < library.size(); ++pos) {
+                    writeBook(library.bookAt(pos));
+                    ++count;
+                }
+                ok(count);
+            }
+        } else if (command == "count") {
+            if (expect(1)) {
+                ok(library.size());
+            }
+        } else if (command == "clear") {
+            if (expect(1)) {
+                library.clearBooks();
+                ok();
+            }
+        } else {
+            fail(line, "unknown command '" + string(command) + "'");
+        }
+    }
+
+public:
+    BatchRunner(Library &library, BufferedWriter &out) : library(library), out(out) {}
+
+    // Execute every command in the stream; returns the number of failed commands
+    size_t run(istream &in) {
+        // The library's own status messages go to cout; keep them out of the output
+        streambuf *previous = cout.rdbuf(nullptr);
+        string text;
+        vector<string_view> args;
+        for (size_t line = 1; getline(in, text); ++line) {
+            if (!text.empty() && text.back() == '\r') {
+                text.pop_back();
+            }
+            if (text.empty() || text[0] == '#') {
+                continue;
+            }
+            args.clear();
+            string_view rest(text);
+            for (size_t tab; (tab = rest.find('\t')) != string_view::npos; rest.remove_prefix(tab + 1)) {
+                args.push_back(rest.substr(0, tab));
+            }
+            args.push_back(rest);
+            ++commands;
+            execute(args, line);
+        }
+        flushRemovals();
+        cout.rdbuf(previous);
+        cout.clear();
+
+        out.write("done\t").number(static_cast<long long>(commands)).write('\t')
+            .number(static_cast<long long>(failures)).write('\n');
+        out.flush();
+        return failures;
+    }
+};
+
+#ifndef LIBRARY_NO_MAIN
+// Main function for library management.
+// "library --batch [script]" runs batch commands from the script (or stdin)
+// instead of the interactive menu; the exit status is 1 if any command failed.
+int main(int argc, char *argv[]) {
     Library library;
     int choice;
 
+    if (argc >= 2 && string(argv[1]) == "--batch") {
+        BufferedWriter out(STDOUT_FILENO);
+        BatchRunner runner(library, out);
+        if (argc < 3 || string(argv[2]) == "-") {
+            return runner.run(cin) == 0 ? 0 : 1;
+        }
+        ifstream script(argv[2]);
+        if (!script.is_open()) {
+            cerr << "Error opening batch script " << argv[2] << endl;
+            return 2;
+        }
+        return runner.run(script) == 0 ? 0 : 1;
+    }
+
     while (true) {
         displayMenu();
         choice = getValidIntegerInput(); // Get valid choice input
@@ -289,8 +5437,11 @@ int main() {
             cin >> price;
             cin.ignore();
 
-            library.addBook(Book(title, author, isbn, year, price));
-            cout << "Book added successfully!" << endl;
+            if (library.addBook(Book(title, author, isbn, year, price))) {
+                cout << "Book added successfully!" << endl;
+            } else {
+                cout << "A book with that ISBN already exists!" << endl;
+            }
 
         } else if (choice == 2) {
             // Remove a book by ISBN
@@ -307,13 +5458,13 @@ int main() {
             cout << "Enter title to search for: ";
             getline(cin, title);
 
-            auto foundBooks = library.searchByTitle(title);
-            if (foundBooks.empty()) {
+            bool found = false;
+            library.forEachByTitle(title, [&](const Book &book) {
+                book.display();
+                return found = true;
+            });
+            if (!found) {
                 cout << "No books found with that title." << endl;
-            } else {
-                for (const auto &book : foundBooks) {
-                    book.display();
-                }
             }
 
         } else if (choice == 4) {
@@ -322,13 +5473,13 @@ int main() {
             cout << "Enter author to search for: ";
             getline(cin, author);
 
-            auto foundBooks = library.searchByAuthor(author);
-            if (foundBooks.empty()) {
+            bool found = false;
+            library.forEachByAuthor(author, [&](const Book &book) {
+                book.display();
+                return found = true;
+            });
+            if (!found) {
                 cout << "No books found by that author." << endl;
-            } else {
-                for (const auto &book : foundBooks) {
-                    book.display();
-                }
             }
 
         } else if (choice == 5) {
@@ -351,8 +5502,14 @@ int main() {
             cout << "Enter filename to load from: ";
             getline(cin, filename);
 
-            library.loadBooksFromFile(filename);
-            cout << "Books loaded from file." << endl;
+            LoadReport report = library.loadBooksFromFile(filename);
+            for (const auto &error : report.errors) {
+                cout << "Line " << error.line << ": " << error.message << endl;
+            }
+            if (report.tornJournalBytes > 0) {
+                cout << "Ignored " << report.tornJournalBytes << " torn bytes at the end of the journal." << endl;
+            }
+            cout << report.loaded << " books loaded from file." << endl;
 
         } else if (choice == 9) {
             // Save books to a file
@@ -398,3 +5555,4 @@ int main() {
 
     return 0;
 }
+#endif // LIBRARY_NO_MAIN
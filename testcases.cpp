@@ -1,7 +1,13 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <map>
+#include <set>
 #include <gtest/gtest.h>
+#define LIBRARY_NO_MAIN
 #include "library.cpp"
 
 // Helper function to create a temporary file with book data
@@ -272,6 +278,1352 @@ TEST(LibraryTest, UpdateBookDetails) {
     ASSERT_EQ(books[0].price, 39.99);
 }
 
+// Test that a second book with the same ISBN is rejected at insert time
+TEST(LibraryTest, AddDuplicateISBNRejected) {
+    Library library;
+    ASSERT_TRUE(library.addBook(Book("C++ Programming", "Bjarne Stroustrup", "12345", 2020, 29.99)));
+    ASSERT_FALSE(library.addBook(Book("Another Title", "Someone Else", "12345", 2001, 9.99)));
+
+    auto books = library.searchByISBN("12345");
+    ASSERT_EQ(books.size(), 1);
+    ASSERT_EQ(books[0].title, "C++ Programming");
+}
+
+// Test that ISBN lookups stay correct after sorting and removals shift positions
+TEST(LibraryTest, ISBNIndexAfterSortAndRemove) {
+    Library library;
+    library.addBook(Book("Book A", "Author A", "111", 2020, 30.0));
+    library.addBook(Book("Book B", "Author B", "222", 2010, 10.0));
+    library.addBook(Book("Book C", "Author C", "333", 2015, 20.0));
+
+    library.sortByPrice();
+    library.removeBook("222");
+
+    ASSERT_TRUE(library.searchByISBN("222").empty());
+    ASSERT_EQ(library.searchByISBN("111")[0].title, "Book A");
+    ASSERT_EQ(library.searchByISBN("333")[0].title, "Book C");
+
+    library.sortByYear();
+    ASSERT_EQ(library.displayBookByISBN("111")->year, 2020);
+
+    library.clearBooks();
+    ASSERT_TRUE(library.searchByISBN("111").empty());
+    ASSERT_TRUE(library.addBook(Book("Book A", "Author A", "111", 2020, 30.0)));
+}
+
+// Test that indexed substring search returns exactly what the linear scan does
+TEST(LibraryTest, SubstringIndexMatchesLinearScan) {
+    Library plain, indexed;
+    indexed.enableSubstringIndex();
+    std::vector<Book> samples = {
+        Book("The C++ Programming Language", "Bjarne Stroustrup", "1", 2013, 59.99),
+        Book("Effective Modern C++", "Scott Meyers", "2", 2014, 45.00),
+        Book("Effective C++", "Scott Meyers", "3", 2005, 39.99),
+        Book("C++ Concurrency in Action", "Anthony Williams", "4", 2019, 49.99),
+        Book("Clean Code", "Robert C. Martin", "5", 2008, 42.50),
+    };
+    for (const auto &book : samples) {
+        plain.addBook(book);
+        indexed.addBook(book);
+    }
+    plain.removeBook("3");
+    indexed.removeBook("3");
+    plain.sortByYear();
+    indexed.sortByYear();
+
+    for (const std::string query : {"C++", "Effective", "ective Mod", "Meyers", "Scott", "C", "", "zzz"}) {
+        auto expected = plain.searchByTitle(query);
+        auto actual = indexed.searchByTitle(query);
+        ASSERT_EQ(actual.size(), expected.size()) << query;
+        for (size_t i = 0; i < expected.size(); ++i) {
+            ASSERT_EQ(actual[i].isbn, expected[i].isbn) << query;
+        }
+        ASSERT_EQ(indexed.searchByAuthor(query).size(), plain.searchByAuthor(query).size()) << query;
+    }
+}
+
+// Test round-tripping books through the memory-mapped binary catalog
+TEST(LibraryTest, BinaryCatalogRoundTrip) {
+    Library library;
+    library.addBook(Book("The C++ Programming", "Bjarne Stroustrup", "12345", 2020, 29.99));
+    library.addBook(Book("Effective Modern C++", "Scott Meyers", "67890", 2017, 35.99));
+    library.addBook(Book("Clean Code", "Robert C. Martin", "11223", 2008, 42.50));
+    std::string filename = "test_books.bin";
+    ASSERT_TRUE(library.saveBooksToBinaryFile(filename));
+
+    // Queries are served straight from the mapping
+    BinaryCatalog catalog;
+    ASSERT_TRUE(catalog.open(filename));
+    ASSERT_EQ(catalog.size(), 3);
+    ASSERT_EQ(catalog.title(1), "Effective Modern C++");
+    ASSERT_EQ(catalog.year(2), 2008);
+    ASSERT_EQ(catalog.price(0), 29.99);
+    ASSERT_EQ(catalog.searchByAuthor("Meyers").size(), 1);
+    auto found = catalog.findByISBN("11223");
+    ASSERT_TRUE(found.has_value());
+    ASSERT_EQ(found->author, "Robert C. Martin");
+    catalog.close();
+
+    Library library2;
+    ASSERT_TRUE(library2.loadBooksFromBinaryFile(filename));
+    auto books = library2.searchByISBN("67890");
+    ASSERT_EQ(books.size(), 1);
+    ASSERT_EQ(books[0].title, "Effective Modern C++");
+    ASSERT_EQ(books[0].price, 35.99);
+
+    std::remove(filename.c_str());
+}
+
+// Edge case: a text file is not accepted as a binary catalog
+TEST(LibraryTest, BinaryCatalogRejectsTextFile) {
+    std::string filename = "test_books.txt";
+    createTempFileForBooks(filename);
+
+    BinaryCatalog catalog;
+    ASSERT_FALSE(catalog.open(filename));
+
+    std::remove(filename.c_str());
+}
+
+// Edge case: headers whose offsets overflow or are misaligned are rejected
+TEST(LibraryTest, BinaryCatalogRejectsCorruptHeader) {
+    Library library;
+    library.addBook(Book("Clean Code", "Robert C. Martin", "11223", 2008, 42.50));
+    std::string filename = "corrupt_books.bin";
+
+    auto corrupt = [&](auto edit) {
+        EXPECT_TRUE(library.saveBooksToBinaryFile(filename));
+        std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+        BinaryCatalog::Header header;
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        edit(header);
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.close();
+        BinaryCatalog catalog;
+        return catalog.open(filename);
+    };
+
+    ASSERT_TRUE(corrupt([](BinaryCatalog::Header &) {}));
+    // offset + size wraps around to a small number
+    ASSERT_FALSE(corrupt([](BinaryCatalog::Header &h) { h.pricesOffset = ~uint64_t(0) - 7; }));
+    ASSERT_FALSE(corrupt([](BinaryCatalog::Header &h) { h.heapSize = ~uint64_t(0) - h.heapOffset + 1; }));
+    ASSERT_FALSE(corrupt([](BinaryCatalog::Header &h) { h.yearsOffset = ~uint64_t(0) - 3; }));
+    // misaligned columns
+    ASSERT_FALSE(corrupt([](BinaryCatalog::Header &h) { h.pricesOffset += 4; }));
+    ASSERT_FALSE(corrupt([](BinaryCatalog::Header &h) { h.yearsOffset += 1; }));
+
+    std::remove(filename.c_str());
+}
+
+// Test that malformed records are skipped and reported with their line numbers
+TEST(LibraryTest, LoadReportsMalformedRecords) {
+    std::string filename = "malformed_books.txt";
+    std::ofstream file(filename);
+    file << "Good Book\nAuthor A\n111\n2001\n10.5\n";
+    file << "Bad Year\nAuthor B\n222\nnineteen\n12.0\n";
+    file << "Bad Price\nAuthor C\n333\n2003\n$$\n";
+    file << "NaN Price\nAuthor F\n444\n2005\nnan\n";
+    file << "Infinite Price\nAuthor G\n555\n2006\n-inf\n";
+    file << "Duplicate\nAuthor D\n111\n2004\n1.0\n";
+    file << "Truncated\nAuthor E\n";
+    file.close();
+
+    Library library;
+    LoadReport report = library.loadBooksFromFile(filename);
+
+    ASSERT_EQ(report.loaded, 1);
+    ASSERT_EQ(report.errors.size(), 6);
+    ASSERT_EQ(report.errors[0].line, 9);
+    ASSERT_EQ(report.errors[1].line, 15);
+    ASSERT_EQ(report.errors[2].line, 20);
+    ASSERT_EQ(report.errors[3].line, 25);
+    ASSERT_EQ(report.errors[4].line, 26);
+    ASSERT_EQ(report.errors[5].line, 31);
+    ASSERT_EQ(library.searchByTitle("").size(), 1);
+
+    std::remove(filename.c_str());
+}
+
+// Test that a catalog split into many small blocks loads in file order on several threads
+TEST(LibraryTest, ParallelLoadKeepsFileOrder) {
+    std::string filename = "many_books.txt";
+    std::ofstream file(filename);
+    for (int i = 0; i < 500; ++i) {
+        file << "Title " << i << "\nAuthor " << i % 7 << "\nISBN-" << i << "\n" << 1900 + i % 120 << "\n" << i * 0.25 << "\n";
+    }
+    file.close();
+
+    Library library;
+    LoadReport report = library.loadBooksFromFile(filename, 4, 64);
+
+    ASSERT_EQ(report.loaded, 500);
+    ASSERT_TRUE(report.errors.empty());
+    auto books = library.searchByTitle("Title ");
+    ASSERT_EQ(books.size(), 500);
+    for (int i = 0; i < 500; ++i) {
+        ASSERT_EQ(books[i].isbn, "ISBN-" + std::to_string(i));
+        ASSERT_EQ(books[i].year, 1900 + i % 120);
+        ASSERT_EQ(books[i].price, i * 0.25);
+    }
+
+    std::remove(filename.c_str());
+}
+
+// Test that journaled mutations are replayed on top of the snapshot
+TEST(LibraryTest, JournalReplayOnLoad) {
+    std::string filename = "journal_books.txt";
+    std::string journalName = filename + ".journal";
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+    {
+        Library library;
+        library.addBook(Book("C++ Programming", "Bjarne Stroustrup", "12345", 2020, 29.99));
+        ASSERT_TRUE(library.enableJournal(filename, 2));
+
+        library.addBook(Book("Effective Modern C++", "Scott Meyers", "67890", 2017, 35.99));
+        library.addBook(Book("Clean Code", "Robert C. Martin", "11223", 2008, 42.50));
+        library.removeBook("12345");
+        library.updateBookDetails(Book("Clean Code 2nd Edition", "Robert C. Martin", "11223", 2024, 44.00));
+        ASSERT_GT(library.journalSize(), 0);
+    }
+
+    // The snapshot still holds only the book present when journaling started
+    std::ifstream snapshot(filename);
+    ASSERT_EQ(Book::loadFromFile(snapshot).isbn, "12345");
+
+    Library library;
+    LoadReport report = library.loadBooksFromFile(filename);
+    ASSERT_EQ(report.loaded, 1);
+    ASSERT_EQ(report.replayed, 4);
+    ASSERT_TRUE(library.searchByISBN("12345").empty());
+    ASSERT_EQ(library.searchByISBN("67890").size(), 1);
+    ASSERT_EQ(library.searchByISBN("11223")[0].title, "Clean Code 2nd Edition");
+
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+}
+
+// Test that compaction folds the journal into the snapshot and ignores a torn tail
+TEST(LibraryTest, JournalCompaction) {
+    std::string filename = "compact_books.txt";
+    std::string journalName = filename + ".journal";
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+    {
+        Library library;
+        ASSERT_TRUE(library.enableJournal(filename, 1, 1 << 20));
+        library.addBook(Book("Book A", "Author A", "111", 2001, 10.0));
+        library.addBook(Book("Book B", "Author B", "222", 2002, 20.0));
+        ASSERT_TRUE(library.compactJournal());
+        ASSERT_EQ(library.journalSize(), 0);
+        library.addBook(Book("Book C", "Author C", "333", 2003, 30.0));
+    }
+
+    // Simulate a crash in the middle of writing a record
+    std::ofstream torn(journalName, std::ios::app | std::ios::binary);
+    torn << "A\x40";
+    torn.close();
+
+    Library library;
+    LoadReport report = library.loadBooksFromFile(filename);
+    ASSERT_EQ(report.loaded, 2);
+    ASSERT_EQ(report.replayed, 1);
+    ASSERT_EQ(report.tornJournalBytes, 2);
+    ASSERT_EQ(library.searchByTitle("Book").size(), 3);
+
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+}
+
+// Test that records appended after a torn tail survive the next load
+TEST(LibraryTest, JournalResumesAfterTornTail) {
+    std::string filename = "torn_books.txt";
+    std::string journalName = filename + ".journal";
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+    {
+        Library library;
+        ASSERT_TRUE(library.enableJournal(filename, 1));
+        library.addBook(Book("Book A", "Author A", "111", 2001, 10.0));
+    }
+
+    std::ofstream torn(journalName, std::ios::app | std::ios::binary);
+    torn << "A\x40\x01";
+    torn.close();
+
+    {
+        Library library;
+        LoadReport report = library.loadBooksFromFile(filename);
+        ASSERT_EQ(report.replayed, 1);
+        ASSERT_EQ(report.tornJournalBytes, 3);
+        ASSERT_TRUE(library.enableJournal(filename, 1));
+        library.addBook(Book("Book B", "Author B", "222", 2002, 20.0));
+    }
+
+    {
+        Library library;
+        LoadReport report = library.loadBooksFromFile(filename);
+        ASSERT_EQ(report.replayed, 2);
+        ASSERT_EQ(report.tornJournalBytes, 0);
+        ASSERT_EQ(library.searchByISBN("111").size(), 1);
+        ASSERT_EQ(library.searchByISBN("222").size(), 1);
+
+        // Saving over the journal's snapshot checkpoints instead of leaving
+        // records that would be replayed a second time
+        ASSERT_TRUE(library.enableJournal(filename, 1));
+        library.removeBook("111");
+        ASSERT_TRUE(library.saveBooksToFile(filename));
+        ASSERT_EQ(library.journalSize(), 0);
+        library.clearBooks();
+    }
+
+    Library library;
+    LoadReport report = library.loadBooksFromFile(filename);
+    ASSERT_EQ(report.loaded, 1);
+    ASSERT_EQ(report.replayed, 1);
+    ASSERT_EQ(library.displayTotalBooks(), 0);
+
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+}
+
+// Test the vectorized range filters against a straightforward scan
+TEST(LibraryTest, RangeQueriesMatchScan) {
+    Library library;
+    std::vector<Book> all;
+    for (int i = 0; i < 1000; ++i) {
+        Book book("Title " + std::to_string(i), "Author", std::to_string(i), 1950 + (i * 37) % 75, (i * 7919 % 10000) / 100.0);
+        all.push_back(book);
+        library.addBook(book);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        library.removeBook(std::to_string(i));
+    }
+    library.sortByYear();
+
+    auto positions = library.findByPriceAndYearRange(20.0, 45.5, 1980, 1999);
+    size_t expected = 0;
+    for (int i = 0; i < 1000; ++i) {
+        const Book &book = all[i];
+        expected += i % 3 != 0 && book.price >= 20.0 && book.price <= 45.5 && book.year >= 1980 && book.year <= 1999;
+    }
+    ASSERT_EQ(positions.size(), expected);
+    for (size_t pos : positions) {
+        const Book &book = library.bookAt(pos);
+        ASSERT_TRUE(book.price >= 20.0 && book.price <= 45.5);
+        ASSERT_TRUE(book.year >= 1980 && book.year <= 1999);
+    }
+    ASSERT_TRUE(std::is_sorted(positions.begin(), positions.end()));
+
+    auto byYear = library.findByYearRange(2000, 2000);
+    for (const auto &isbn : library.isbnsAt(byYear)) {
+        ASSERT_EQ(library.searchByISBN(isbn)[0].year, 2000);
+    }
+    ASSERT_TRUE(library.findByPriceRange(200.0, 300.0).empty());
+}
+
+// Test that ordered views agree with and without the maintained indexes
+TEST(LibraryTest, OrderedIndexesMatchSorting) {
+    Library indexed, plain;
+    indexed.enableOrderedIndexes();
+    for (int i = 0; i < 200; ++i) {
+        Book book("Title " + std::to_string(i * 31 % 200), "Author " + std::to_string(i % 9),
+                  std::to_string(i), 1990 + i % 25, (i * 13 % 50) + 0.99);
+        indexed.addBook(book);
+        plain.addBook(book);
+    }
+    for (int i = 0; i < 200; i += 5) {
+        indexed.removeBook(std::to_string(i));
+        plain.removeBook(std::to_string(i));
+    }
+    indexed.updateBookDetails(Book("Zeta", "Author 1", "1", 2030, 0.01));
+    plain.updateBookDetails(Book("Zeta", "Author 1", "1", 2030, 0.01));
+
+    for (SortKey key : {SortKey::Price, SortKey::Year, SortKey::Title, SortKey::Author}) {
+        for (bool descending : {false, true}) {
+            auto expected = plain.topK(key, 1000, descending);
+            auto actual = indexed.topK(key, 1000, descending);
+            ASSERT_EQ(actual.size(), 160);
+            for (size_t i = 0; i < expected.size(); ++i) {
+                ASSERT_EQ(actual[i].isbn, expected[i].isbn);
+            }
+        }
+    }
+
+    auto cheapest = indexed.topK(SortKey::Price, 3);
+    ASSERT_EQ(cheapest[0].isbn, "1");
+    ASSERT_LE(cheapest[1].price, cheapest[2].price);
+    auto newest = indexed.topK(SortKey::Year, 1, true);
+    ASSERT_EQ(newest[0].year, 2030);
+
+    auto band = indexed.rangeByPrice(10.0, 20.0);
+    ASSERT_EQ(band.size(), plain.rangeByPrice(10.0, 20.0).size());
+    for (size_t i = 1; i < band.size(); ++i) {
+        ASSERT_LE(band[i - 1].price, band[i].price);
+    }
+    ASSERT_EQ(indexed.rangeByYear(2000, 2004).size(), plain.rangeByYear(2000, 2004).size());
+}
+
+// Test paged and visitor searches against the copying search
+TEST(LibraryTest, PagedSearchResults) {
+    Library library;
+    for (int i = 0; i < 120; ++i) {
+        library.addBook(Book("C++ Volume " + std::to_string(i), i % 2 ? "Scott Meyers" : "Herb Sutter",
+                             std::to_string(i), 2000 + i % 20, 10.0 + i));
+    }
+    auto all = library.searchByTitle("C++");
+
+    auto firstPage = library.findByTitle("C++", 0, 50);
+    auto lastPage = library.findByTitle("C++", 100, 50);
+    ASSERT_EQ(firstPage.size(), 50);
+    ASSERT_EQ(lastPage.size(), 20);
+    ASSERT_EQ(library.bookAt(firstPage[0]).isbn, all[0].isbn);
+    ASSERT_EQ(library.bookAt(lastPage[19]).isbn, all[119].isbn);
+    ASSERT_TRUE(library.findByTitle("C++", 500, 50).empty());
+
+    library.enableSubstringIndex();
+    auto allMeyers = library.findByAuthor("Meyers");
+    ASSERT_EQ(allMeyers.size(), 60);
+    ASSERT_EQ(library.findByAuthor("Meyers", 10, 5),
+              std::vector<size_t>(allMeyers.begin() + 10, allMeyers.begin() + 15));
+
+    size_t visited = 0;
+    library.forEachByAuthor("Sutter", [&](const Book &book) {
+        EXPECT_EQ(book.author, "Herb Sutter");
+        return ++visited < 7;
+    });
+    ASSERT_EQ(visited, 7);
+}
+
+// Test the arena-backed catalog against the Library it was built from
+TEST(LibraryTest, CompactCatalogMatchesLibrary) {
+    Library library;
+    for (int i = 0; i < 300; ++i) {
+        library.addBook(Book("A Fairly Long Book Title Number " + std::to_string(i),
+                             "Prolific Author Number " + std::to_string(i % 4),
+                             "978-0-00-" + std::to_string(100000 + i), 1980 + i % 40, i * 0.5));
+    }
+    CompactCatalog compact = library.toCompactCatalog();
+
+    ASSERT_EQ(compact.size(), 300);
+    ASSERT_EQ(compact.authorCount(), 4);
+    ASSERT_EQ(compact.findByAuthor("Number 3").size(), library.searchByAuthor("Number 3").size());
+    ASSERT_EQ(compact.findByTitle("Number 12").size(), library.searchByTitle("Number 12").size());
+    size_t pos = compact.findByISBN("978-0-00-100042");
+    ASSERT_EQ(compact.title(pos), "A Fairly Long Book Title Number 42");
+    ASSERT_EQ(compact.author(pos), "Prolific Author Number 2");
+    ASSERT_EQ(compact.bookAt(pos).price, 21.0);
+    ASSERT_FALSE(compact.add(library.bookAt(0)));
+
+    MemoryUsage current = library.bookMemoryUsage();
+    MemoryUsage arena = compact.memoryUsage();
+    ASSERT_LT(arena.allocations, current.allocations);
+    // Most of the first arena block is still free at this size
+    ASSERT_GT(arena.unusedBytes, 0);
+    ASSERT_LT(arena.bytes - arena.unusedBytes, current.bytes);
+}
+
+// Test loading a text catalog directly into the arena
+TEST(LibraryTest, CompactCatalogLoadFromFile) {
+    std::string filename = "compact_books.txt";
+    createTempFileForBooks(filename);
+
+    CompactCatalog compact;
+    LoadReport report = compact.loadFromFile(filename);
+    ASSERT_EQ(report.loaded, 2);
+    ASSERT_TRUE(report.errors.empty());
+    ASSERT_EQ(compact.author(compact.findByISBN("67890")), "Scott Meyers");
+
+    std::remove(filename.c_str());
+}
+
+// Test batch insert and batch removal with per-item status
+TEST(LibraryTest, BulkAddAndRemove) {
+    Library library;
+    library.enableSubstringIndex();
+    library.enableOrderedIndexes();
+
+    std::vector<Book> batch;
+    for (int i = 0; i < 1000; ++i) {
+        batch.emplace_back("Title " + std::to_string(i), "Author " + std::to_string(i % 10),
+                           std::to_string(i), 1900 + i % 100, i * 1.0);
+    }
+    batch.emplace_back("Repeat", "Author", "7", 2000, 1.0);
+    auto added = library.addBooks(std::move(batch));
+    ASSERT_EQ(added.size(), 1001);
+    ASSERT_EQ(added[999], ItemStatus::Ok);
+    ASSERT_EQ(added[1000], ItemStatus::DuplicateISBN);
+
+    std::vector<std::string> victims;
+    for (int i = 0; i < 1000; i += 2) {
+        victims.push_back(std::to_string(i));
+    }
+    victims.push_back("missing");
+    victims.push_back("0");
+    auto removed = library.removeBooks(victims);
+    ASSERT_EQ(removed[0], ItemStatus::Ok);
+    ASSERT_EQ(removed[500], ItemStatus::NotFound);
+    ASSERT_EQ(removed[501], ItemStatus::NotFound);
+
+    ASSERT_EQ(library.searchByTitle("Title").size(), 500);
+    ASSERT_TRUE(library.searchByISBN("998").empty());
+    ASSERT_EQ(library.searchByISBN("999")[0].title, "Title 999");
+    ASSERT_EQ(library.searchByAuthor("Author 3").size(), 100);
+    ASSERT_EQ(library.findByYearRange(1900, 1909).size(), 50);
+    ASSERT_EQ(library.topK(SortKey::Price, 1)[0].isbn, "1");
+}
+
+// Stress test: readers always see a complete batch while a writer publishes new versions
+TEST(LibraryTest, ConcurrentSnapshotReads) {
+    ConcurrentLibrary library;
+    std::atomic<bool> done(false);
+    std::atomic<size_t> reads(0);
+    std::atomic<size_t> torn(0);
+
+    // Every batch adds a pair of books, so a consistent snapshot has an even count
+    auto reader = [&] {
+        while (!done) {
+            auto snapshot = library.snapshot();
+            size_t left = snapshot->searchByTitle("Left").size();
+            size_t right = snapshot->searchByAuthor("Right").size();
+            if (left != right) {
+                ++torn;
+            }
+            ++reads;
+        }
+    };
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back(reader);
+    }
+
+    for (int batch = 0; batch < 200; ++batch) {
+        library.update([&](Library &next) {
+            next.addBook(Book("Left " + std::to_string(batch), "Writer", "L" + std::to_string(batch), 2000, 1.0));
+            next.addBook(Book("Other " + std::to_string(batch), "Right", "R" + std::to_string(batch), 2000, 1.0));
+        });
+    }
+    done = true;
+    for (auto &thread : readers) {
+        thread.join();
+    }
+
+    ASSERT_EQ(torn, 0);
+    ASSERT_GT(reads, 0);
+    ASSERT_EQ(library.searchByTitle("Left").size(), 200);
+    ASSERT_TRUE(library.findByISBN("R199").has_value());
+    ASSERT_FALSE(library.findByISBN("R200").has_value());
+}
+
+// Test that instrumentation scopes collect calls, counters and latency buckets
+TEST(LibraryTest, InstrumentationSnapshot) {
+    Instrumentation::reset();
+    size_t op = Instrumentation::registerOperation("test.scope");
+    ASSERT_EQ(Instrumentation::registerOperation("test.scope"), op);
+    for (int i = 0; i < 10; ++i) {
+        Instrumentation::Scope scope(op);
+        Instrumentation::record(Instrumentation::Scanned, 5);
+        Instrumentation::record(Instrumentation::Returned, 1);
+    }
+    size_t liveThreads = Instrumentation::liveThreads();
+    for (int i = 0; i < 4; ++i) {
+        std::thread([op] {
+            Instrumentation::Scope scope(op);
+            Instrumentation::record(Instrumentation::BytesRead, 25);
+        }).join();
+    }
+    // Exited threads are folded into the retired totals
+    ASSERT_EQ(Instrumentation::liveThreads(), liveThreads);
+    Instrumentation::record(Instrumentation::Scanned, 1000); // No scope: dropped
+
+    bool found = false;
+    for (const auto &stats : Instrumentation::snapshot()) {
+        if (stats.name == "test.scope") {
+            found = true;
+            ASSERT_EQ(stats.calls, 14);
+            ASSERT_EQ(stats.counters[Instrumentation::Scanned], 50);
+            ASSERT_EQ(stats.counters[Instrumentation::Returned], 10);
+            ASSERT_EQ(stats.counters[Instrumentation::BytesRead], 100);
+            ASSERT_LE(stats.percentile(0.5), stats.percentile(0.99));
+            ASSERT_LE(stats.percentile(0.99), stats.maxNanos);
+        }
+    }
+    ASSERT_TRUE(found);
+
+    for (uint64_t nanos : {0ULL, 7ULL, 8ULL, 1000ULL, 123456789ULL, 1ULL << 62}) {
+        size_t bucket = Instrumentation::bucketOf(nanos);
+        ASSERT_LT(bucket, Instrumentation::histogramBuckets);
+        ASSERT_GE(Instrumentation::bucketUpperBound(bucket), nanos);
+        ASSERT_GE(nanos + nanos / 8, Instrumentation::bucketUpperBound(bucket));
+    }
+
+    std::ostringstream json;
+    Instrumentation::dumpJson(json);
+    ASSERT_NE(json.str().find("\"name\":\"test.scope\",\"calls\":14"), std::string::npos);
+    Instrumentation::reset();
+    ASSERT_TRUE(Instrumentation::snapshot().empty());
+}
+
+// Test that buffered rendering matches the iostream table and the exporters escape fields
+TEST(LibraryTest, BufferedRenderingAndExport) {
+    Library library;
+    library.addBook(Book("A Very Long Title That Overflows", "Author, \"Quoted\"", "111", 1999, 12.5));
+    library.addBook(Book("Short", "Line\nBreak", "222", -5, 1234567.0));
+    library.addBook(Book("Tab\tTitle", "Back\\slash", "333", 2024, 0.1));
+
+    std::ostringstream expected;
+    expected << std::left << std::setw(20) << "Title" << std::setw(20) << "Author" << std::setw(15) << "ISBN"
+             << std::setw(10) << "Year" << std::setw(10) << "Price" << "\n";
+    for (size_t i = 0; i < 3; ++i) {
+        const Book &book = library.bookAt(i);
+        expected << std::setw(20) << book.title << std::setw(20) << book.author << std::setw(15) << book.isbn
+                 << std::setw(10) << book.year << std::setw(10) << book.price << "\n";
+    }
+    std::ostringstream rendered;
+    {
+        BufferedWriter out(rendered, 16); // Tiny chunks exercise the spill path
+        std::vector<Book> copies = {library.bookAt(0), library.bookAt(1), library.bookAt(2)};
+        writeBookTable(out, copies);
+    }
+    ASSERT_EQ(rendered.str(), expected.str());
+
+    auto exported = [&](bool csv) {
+        std::string path = "export_test.out";
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        EXPECT_TRUE(csv ? library.exportCsv(fd) : library.exportJsonLines(fd));
+        ::close(fd);
+        std::ifstream file(path, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        std::remove(path.c_str());
+        return text;
+    };
+    ASSERT_EQ(exported(true),
+              "title,author,isbn,year,price\r\n"
+              "A Very Long Title That Overflows,\"Author, \"\"Quoted\"\"\",111,1999,12.5\r\n"
+              "Short,\"Line\nBreak\",222,-5,1234567\r\n"
+              "Tab\tTitle,Back\\slash,333,2024,0.1\r\n");
+    ASSERT_EQ(exported(false),
+              "{\"title\":\"A Very Long Title That Overflows\",\"author\":\"Author, \\\"Quoted\\\"\",\"isbn\":\"111\",\"year\":1999,\"price\":12.5}\n"
+              "{\"title\":\"Short\",\"author\":\"Line\\nBreak\",\"isbn\":\"222\",\"year\":-5,\"price\":1234567}\n"
+              "{\"title\":\"Tab\\tTitle\",\"author\":\"Back\\\\slash\",\"isbn\":\"333\",\"year\":2024,\"price\":0.1}\n");
+}
+
+// Test batch commands: responses, escaping, errors and batched removals
+TEST(LibraryTest, BatchModeCommands) {
+    Library library;
+    std::istringstream script(
+        "add\tFirst Title\tAuthor A\t111\t2001\t10.5\n"
+        "add\tSecond\\tTitle\tAuthor B\t222\t2002\t20\n"
+        "add\tDuplicate\tAuthor C\t111\t2003\t30\n"
+        "# comments and blank lines are skipped\n"
+        "\n"
+        "add\tThird\tAuthor A\t333\t1999\tcheap\n"
+        "remove\t111\n"
+        "remove\t404\n"
+        "author\tAuthor\n"
+        "update\tRenamed\tAuthor B\t222\t2010\t25\n"
+        "get\t222\n"
+        "count\n"
+        "frobnicate\n"
+        "add\tFourth\tAuthor A\t444\t1999\tnan\n"
+        "add\tFifth\tAuthor A\t555\t1999\t-inf\n"
+        "update\tRenamed\tAuthor B\t222\t2010\tinf\n");
+    std::ostringstream output;
+    size_t failures;
+    {
+        BufferedWriter out(output);
+        BatchRunner runner(library, out);
+        failures = runner.run(script);
+    }
+
+    ASSERT_EQ(failures, 7);
+    ASSERT_EQ(output.str(),
+              "ok\n"
+              "ok\n"
+              "error\t3\tduplicate ISBN '111'\n"
+              "error\t6\tinvalid price 'cheap'\n"
+              "ok\n"
+              "error\t8\tnot found\n"
+              "book\tSecond\\tTitle\tAuthor B\t222\t2002\t20\n"
+              "ok\t1\n"
+              "ok\n"
+              "book\tRenamed\tAuthor B\t222\t2010\t25\n"
+              "ok\t1\n"
+              "ok\t1\n"
+              "error\t13\tunknown command 'frobnicate'\n"
+              "error\t14\tinvalid price 'nan'\n"
+              "error\t15\tinvalid price '-inf'\n"
+              "error\t16\tinvalid price 'inf'\n"
+              "done\t14\t7\n");
+    ASSERT_EQ(library.searchByISBN("222")[0].title, "Renamed");
+    ASSERT_EQ(library.searchByISBN("222")[0].price, 25);
+    ASSERT_TRUE(library.searchByISBN("444").empty());
+}
+
+// Test fuzzy search: bit-parallel distances, ranking, and identical results with the index
+TEST(LibraryTest, FuzzySearch) {
+    auto naive = [](std::string pattern, std::string text) {
+        for (auto &c : pattern) c = std::tolower(static_cast<unsigned char>(c));
+        for (auto &c : text) c = std::tolower(static_cast<unsigned char>(c));
+        std::vector<size_t> column(pattern.size() + 1);
+        for (size_t i = 0; i <= pattern.size(); ++i) column[i] = i;
+        size_t best = column.back();
+        for (char c : text) {
+            std::vector<size_t> next(pattern.size() + 1, 0);
+            for (size_t i = 1; i <= pattern.size(); ++i) {
+                next[i] = std::min({column[i - 1] + (pattern[i - 1] == c ? 0 : 1), column[i] + 1, next[i - 1] + 1});
+            }
+            column = next;
+            best = std::min(best, column.back());
+        }
+        return best;
+    };
+    std::mt19937 rng(7);
+    auto randomText = [&](size_t length) {
+        std::string text;
+        for (size_t i = 0; i < length; ++i) text += "abcAB "[rng() % 6];
+        return text;
+    };
+    for (int i = 0; i < 500; ++i) {
+        std::string pattern = randomText(1 + rng() % 80), text = randomText(rng() % 120);
+        ASSERT_EQ(FuzzyPattern(pattern).distance(text), naive(pattern, text)) << pattern << " / " << text;
+    }
+
+    Library library;
+    library.addBook(Book("Effective Modern C++", "Scott Meyers", "1", 2014, 40));
+    library.addBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "2", 2013, 60));
+    library.addBook(Book("Programming Pearls", "Jon Bentley", "3", 1999, 30));
+    library.addBook(Book("Algorithms", "Robert Sedgewick", "4", 2011, 80));
+    for (int i = 0; i < 200; ++i) {
+        library.addBook(Book("Filler Volume " + std::to_string(i), "Anonymous", "F" + std::to_string(i), 2000, 1));
+    }
+
+    auto titles = [&](const std::vector<FuzzyMatch> &matches) {
+        std::vector<std::string> result;
+        for (const auto &match : matches) result.push_back(library.bookAt(match.position).title);
+        return result;
+    };
+    auto scanned = library.fuzzyFindByTitle("programing", 2, 10);
+    ASSERT_EQ(titles(scanned), (std::vector<std::string>{"Programming Pearls", "The C++ Programming Language"}));
+    ASSERT_EQ(scanned[0].distance, 1);
+    auto authors = library.fuzzyFindByAuthor("stroustrop", 1);
+    ASSERT_EQ(authors.size(), 1);
+    ASSERT_EQ(library.bookAt(authors[0].position).author, "Bjarne Stroustrup");
+    ASSERT_TRUE(library.fuzzyFindByTitle("quantum chromodynamics", 2).empty());
+
+    Library indexed = library;
+    indexed.enableFuzzyIndex();
+    indexed.removeBooks({"F3", "F4"});
+    library.removeBooks({"F3", "F4"});
+    indexed.addBook(Book("Programming in Lua", "Roberto Ierusalimschy", "5", 2016, 45));
+    library.addBook(Book("Programming in Lua", "Roberto Ierusalimschy", "5", 2016, 45));
+    for (std::string query : {"programing", "ALGORITMS", "Volume 17", "sedgwick", "lua", "Meyrs"}) {
+        auto plain = library.fuzzyFindByTitle(query, 2, 5), fast = indexed.fuzzyFindByTitle(query, 2, 5);
+        ASSERT_EQ(titles(plain), titles(fast)) << query;
+        ASSERT_EQ(library.fuzzyFindByAuthor(query, 1, 100).size(), indexed.fuzzyFindByAuthor(query, 1, 100).size());
+    }
+}
+
+// Test that autocomplete stays equal to a brute-force count through inserts, removals and compaction
+TEST(LibraryTest, PrefixAutocomplete) {
+    Library library;
+    library.addBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "1", 2013, 60));
+    library.addBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "2", 1997, 50));
+    library.addBook(Book("Programming Pearls", "Jon Bentley", "3", 1999, 30));
+    library.enableAutocomplete();
+    library.addBook(Book("Pragmatic Programmer", "Andrew Hunt", "4", 1999, 40));
+
+    auto titles = library.completeTitle("PRO", 5);
+    ASSERT_EQ(titles.size(), 3);
+    ASSERT_EQ(titles[0].text, "The C++ Programming Language");
+    ASSERT_EQ(titles[0].count, 2);
+    ASSERT_EQ(titles[1].text, "Pragmatic Programmer"); // Ties break alphabetically
+    ASSERT_EQ(titles[2].text, "Programming Pearls");
+    ASSERT_EQ(library.completeTitle("c++", 5).size(), 1);
+    ASSERT_TRUE(library.completeTitle("rogramming", 5).empty()); // Only word starts match
+    ASSERT_EQ(library.completeAuthor("str", 5)[0].text, "Bjarne Stroustrup");
+
+    std::mt19937 rng(11);
+    const char *words[] = {"alpha", "Beta", "gamma", "Delta", "alps", "bet", "gam", "del"};
+    std::map<std::string, size_t> expected;
+    for (auto title : {"The C++ Programming Language", "The C++ Programming Language", "Programming Pearls",
+                       "Pragmatic Programmer"}) {
+        ++expected[title];
+    }
+    std::vector<std::string> isbns;
+    for (int i = 0; i < 8000; ++i) {
+        if (!isbns.empty() && rng() % 5 < 2) {
+            size_t pick = rng() % isbns.size();
+            std::string title = library.searchByISBN(isbns[pick])[0].title;
+            if (--expected[title] == 0) expected.erase(title);
+            library.removeBook(isbns[pick]);
+            isbns.erase(isbns.begin() + pick);
+            continue;
+        }
+        std::string title = std::string(words[rng() % 8]) + " " + words[rng() % 8] + " " + std::to_string(rng() % 900);
+        std::string isbn = "R" + std::to_string(i);
+        library.addBook(Book(title, "Anon", isbn, 2000, 1));
+        isbns.push_back(isbn);
+        ++expected[title];
+    }
+
+    // Ties may come back in any order, so compare counts rank by rank
+    for (std::string prefix : {"al", "BET", "gam", "del", "alpha b", "7", "zeta"}) {
+        std::string wanted = prefix;
+        for (auto &c : wanted) c = std::tolower(static_cast<unsigned char>(c));
+        auto matches = [&](std::string folded) {
+            for (auto &c : folded) c = std::tolower(static_cast<unsigned char>(c));
+            for (size_t i = 0; i < folded.size(); ++i) {
+                bool start = std::isalnum(static_cast<unsigned char>(folded[i])) &&
+                             (i == 0 || !std::isalnum(static_cast<unsigned char>(folded[i - 1])));
+                if (start && folded.compare(i, wanted.size(), wanted) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        std::vector<size_t> counts;
+        for (const auto &entry : expected) {
+            if (matches(entry.first)) counts.push_back(entry.second);
+        }
+        std::sort(counts.rbegin(), counts.rend());
+
+        auto completions = library.completeTitle(prefix, 20);
+        ASSERT_EQ(completions.size(), std::min<size_t>(20, counts.size())) << prefix;
+        std::set<std::string> distinct;
+        for (size_t i = 0; i < completions.size(); ++i) {
+            ASSERT_TRUE(matches(completions[i].text)) << prefix;
+            ASSERT_EQ(completions[i].count, expected[completions[i].text]) << prefix;
+            ASSERT_EQ(completions[i].count, counts[i]) << prefix;
+            distinct.insert(completions[i].text);
+        }
+        ASSERT_EQ(distinct.size(), completions.size());
+    }
+}
+
+// Test that a sharded library answers like a single one, with ordered merges across shards
+TEST(LibraryTest, ShardedLibraryMatchesSingle) {
+    Library single;
+    ShardedLibrary sharded(4, 3);
+    std::vector<Book> batch;
+    for (int i = 0; i < 500; ++i) {
+        batch.push_back(Book((i % 3 ? "Volume " : "Guide ") + std::to_string(i), "Author " + std::to_string(i % 17),
+                             "S" + std::to_string(i), 1950 + (i * 7) % 70, (i * 37) % 100 + 0.5));
+    }
+    batch.push_back(batch[10]); // Duplicate ISBN
+    auto status = sharded.addBooks(batch);
+    single.addBooks(batch);
+    ASSERT_EQ(status.size(), 501);
+    ASSERT_EQ(status[10], ItemStatus::Ok);
+    ASSERT_EQ(status[500], ItemStatus::DuplicateISBN);
+    ASSERT_EQ(sharded.size(), 500);
+    size_t largest = 0;
+    for (size_t i = 0; i < sharded.shardCount(); ++i) {
+        largest = std::max(largest, sharded.shard(i).size());
+    }
+    ASSERT_LT(largest, 250); // Spread over the shards
+
+    ASSERT_TRUE(sharded.removeBook("S3"));
+    ASSERT_FALSE(sharded.removeBook("S3"));
+    single.removeBooks({"S3"});
+    ASSERT_TRUE(sharded.updateBookDetails(Book("Guide Renamed", "Author 1", "S6", 2001, 9.5)));
+    single.updateBookDetails(Book("Guide Renamed", "Author 1", "S6", 2001, 9.5));
+    ASSERT_EQ(sharded.findByISBN("S6")->title, "Guide Renamed");
+    ASSERT_FALSE(sharded.findByISBN("S3").has_value());
+
+    auto isbns = [](std::vector<Book> books) {
+        std::vector<std::string> result;
+        for (const auto &book : books) result.push_back(book.isbn);
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+    ASSERT_EQ(isbns(sharded.searchByTitle("Guide")), isbns(single.searchByTitle("Guide")));
+    sharded.enableSubstringIndex();
+    ASSERT_EQ(isbns(sharded.searchByAuthor("Author 1")), isbns(single.searchByAuthor("Author 1")));
+
+    auto prices = [](const std::vector<Book> &books) {
+        std::vector<double> result;
+        for (const auto &book : books) result.push_back(book.price);
+        return result;
+    };
+    auto years = [](const std::vector<Book> &books) {
+        std::vector<int> result;
+        for (const auto &book : books) result.push_back(book.year);
+        return result;
+    };
+    ASSERT_EQ(prices(sharded.sortedByPrice()), prices(single.topK(SortKey::Price, 1000)));
+    ASSERT_EQ(years(sharded.sortedByYear()), years(single.topK(SortKey::Year, 1000)));
+    ASSERT_EQ(prices(sharded.rangeByPrice(20, 40)), prices(single.rangeByPrice(20, 40)));
+    ASSERT_EQ(years(sharded.rangeByYear(1960, 1970)), years(single.rangeByYear(1960, 1970)));
+    sharded.enableOrderedIndexes();
+    ASSERT_EQ(prices(sharded.topK(SortKey::Price, 5, true)), prices(single.topK(SortKey::Price, 5, true)));
+    auto titles = sharded.topK(SortKey::Title, 3);
+    ASSERT_EQ(titles[0].title, single.topK(SortKey::Title, 1)[0].title);
+}
+
+// Test composed queries against brute force under every index configuration, and the planner's choices
+TEST(LibraryTest, QueryPlannerMatchesBruteForce) {
+    Library library;
+    const char *authors[] = {"Scott Meyers", "Herb Sutter", "Bjarne Stroustrup", "Nicolai Josuttis"};
+    for (int i = 0; i < 400; ++i) {
+        library.addBook(Book("Book " + std::to_string(i) + (i % 5 ? " C++" : " Design"), authors[i % 4],
+                             "Q" + std::to_string(i), 1995 + i % 30, 10 + (i * 13) % 60));
+    }
+    library.sortByPrice(); // Catalog order no longer matches insertion order
+
+    std::vector<Query> queries = {
+        Query::author("Meyers") && Query::yearBetween(2011, INT_MAX) && Query::priceBetween(0, 40),
+        Query::isbn("Q42") && Query::author("Sutter"),
+        Query::isbn("Q42") || Query::isbn("Q7") || Query::title("Design"),
+        Query::title("Design") && (Query::yearBetween(2000, 2005) || Query::priceBetween(60, 70)),
+        Query::all(),
+        Query::yearBetween(2010, 2012),
+    };
+    auto expected = [&](const Query &query) {
+        std::vector<std::string> result;
+        for (size_t pos = 0; pos < library.size(); ++pos) {
+            if (query.matches(library.bookAt(pos))) result.push_back(library.bookAt(pos).isbn);
+        }
+        return result;
+    };
+    auto found = [&](const Query &query) {
+        return library.isbnsAt(library.findWhere(query));
+    };
+
+    for (int config = 0; config < 3; ++config) {
+        library.enableSubstringIndex(config >= 1);
+        library.enableOrderedIndexes(config >= 2);
+        for (const auto &query : queries) {
+            ASSERT_EQ(found(query), expected(query)) << library.explain(query);
+
+            Query limited = query;
+            limited.limit(3);
+            auto all = expected(query);
+            all.resize(std::min<size_t>(3, all.size()));
+            ASSERT_EQ(found(limited), all) << library.explain(limited);
+
+            Query ordered = query;
+            ordered.orderBy(SortKey::Price, true).limit(5);
+            auto books = library.findWhere(ordered);
+            ASSERT_EQ(books.size(), std::min<size_t>(5, expected(query).size()));
+            for (size_t i = 1; i < books.size(); ++i) {
+                ASSERT_GE(library.bookAt(books[i - 1]).price, library.bookAt(books[i]).price);
+            }
+            if (!books.empty()) {
+                double top = 0;
+                for (const auto &isbn : expected(query)) top = std::max(top, library.searchByISBN(isbn)[0].price);
+                ASSERT_EQ(library.bookAt(books[0]).price, top);
+            }
+        }
+    }
+
+    ASSERT_EQ(library.explain(queries[1]).rfind("access: isbn lookup (1 candidates)", 0), 0);
+    ASSERT_NE(library.explain(queries[2]).find("union of (isbn lookup, isbn lookup, trigram index on title)"),
+              std::string::npos);
+    ASSERT_NE(library.explain(queries[0]).find("author contains 'Meyers' AND year in [2011, 2147483647]"),
+              std::string::npos);
+    library.enableOrderedIndexes(false);
+    ASSERT_EQ(library.explain(queries[5]).rfind("access: column scan on year", 0), 0);
+    library.enableSubstringIndex(false);
+    ASSERT_EQ(library.explain(Query::title("Design")).rfind("access: full scan", 0), 0);
+}
+
+// Test that descending orders keep equal keys in insertion order on every query path
+TEST(LibraryTest, DescendingTiesKeepInsertionOrder) {
+    Library library;
+    library.addBook(Book("Tie One", "X", "T1", 2001, 20.0));
+    library.addBook(Book("Cheap", "X", "C1", 2002, 5.0));
+    library.addBook(Book("Tie Two", "X", "T2", 2003, 20.0));
+    library.addBook(Book("Other", "Y", "O1", 2004, 30.0));
+    library.addBook(Book("Tie Three", "X", "T3", 2005, 20.0));
+    library.sortByPrice(); // Catalog order no longer matches insertion order
+
+    Query everything = Query::all();
+    everything.orderBy(SortKey::Price, true);
+    Query byAuthor = Query::author("X");
+    byAuthor.orderBy(SortKey::Price, true);
+    for (int config = 0; config < 4; ++config) {
+        library.enableSubstringIndex(config & 1);
+        library.enableOrderedIndexes(config & 2);
+        ASSERT_EQ(library.isbnsAt(library.findWhere(everything)),
+                  std::vector<std::string>({"O1", "T1", "T2", "T3", "C1"})) << library.explain(everything);
+        ASSERT_EQ(library.isbnsAt(library.findWhere(byAuthor)),
+                  std::vector<std::string>({"T1", "T2", "T3", "C1"})) << library.explain(byAuthor);
+        auto top = library.topK(SortKey::Price, 2, true);
+        ASSERT_EQ(top[1].isbn, "T1");
+    }
+}
+
+// Async save writes the catalog as it was when the call was made
+TEST(LibraryTest, AsyncSaveCapturesPointInTime) {
+    Library library;
+    for (int i = 0; i < 200; ++i) {
+        library.addBook(Book("Title " + std::to_string(i), "Author", "isbn-" + std::to_string(i), 2000, 10.0));
+    }
+
+    std::atomic<bool> notified{false};
+    auto pending = library.saveBooksToFileAsync("async_save.txt", [&](const SaveResult &result) {
+        notified = result.ok;
+    });
+    for (int i = 0; i < 100; ++i) {
+        library.removeBook("isbn-" + std::to_string(i));
+    }
+    library.addBook(Book("Late", "Author", "late", 2020, 1.0));
+
+    SaveResult result = pending.get();
+    ASSERT_TRUE(result.ok) << result.error;
+    ASSERT_TRUE(notified);
+    std::ifstream file("async_save.txt", std::ios::binary | std::ios::ate);
+    ASSERT_EQ(result.bytes, static_cast<uint64_t>(file.tellg()));
+
+    Library loaded;
+    loaded.loadBooksFromFile("async_save.txt");
+    ASSERT_EQ(loaded.size(), 200u);
+    ASSERT_EQ(loaded.searchByISBN("isbn-0").size(), 1u);
+    ASSERT_TRUE(loaded.searchByISBN("late").empty());
+
+    ConcurrentLibrary shared;
+    shared.update([](Library &next) { next.addBook(Book("Shared", "Author", "shared", 2001, 2.0)); });
+    result = shared.saveBooksToFileAsync("async_save.txt").get();
+    ASSERT_TRUE(result.ok) << result.error;
+    Library reloaded;
+    reloaded.loadBooksFromFile("async_save.txt");
+    ASSERT_EQ(reloaded.size(), 1u);
+    std::remove("async_save.txt");
+
+    result = library.saveBooksToFileAsync("no_such_dir/async_save.txt").get();
+    ASSERT_FALSE(result.ok);
+    ASSERT_FALSE(result.error.empty());
+}
+
+// ISBN-10 and ISBN-13 spellings of one book share a canonical key
+TEST(LibraryTest, CanonicalIsbnKeys) {
+    auto key = IsbnKey::parse("978-0-306-40615-7");
+    ASSERT_TRUE(key.has_value());
+    ASSERT_EQ(key->toString(), "9780306406157");
+    ASSERT_TRUE(IsbnKey::parse("0-306-40615-2") == key);
+    ASSERT_TRUE(IsbnKey::parse("9780306406157") == key);
+    ASSERT_EQ(IsbnKey::parse("080442957X")->toString(), "9780804429573");
+    ASSERT_FALSE(IsbnKey::parse("978-0-306-40615-8").has_value());  // bad check digit
+    ASSERT_FALSE(IsbnKey::parse("0-306-40615-3").has_value());
+    ASSERT_FALSE(IsbnKey::parse("1234567890123").has_value());      // not 978/979
+    ASSERT_FALSE(IsbnKey::parse("12345").has_value());
+    ASSERT_FALSE(IsbnKey::parse("X123456789").has_value());
+    ASSERT_FALSE(IsbnKey::parse("978030640X155").has_value());     // X inside an ISBN-13
+    ASSERT_FALSE(IsbnKey::parse("978030640615X").has_value());
+    ASSERT_FALSE(IsbnKey::parse("03064X6152").has_value());        // X before the check digit
+    ASSERT_LT(*IsbnKey::parse("9780306406157"), *IsbnKey::parse("9791234567896"));
+
+    Library library;
+    ASSERT_TRUE(library.addBook(Book("Numerical", "Author", "978-0-306-40615-7", 1990, 10.0)));
+    ASSERT_FALSE(library.addBook(Book("Numerical", "Author", "0306406152", 1990, 10.0)));
+    ASSERT_TRUE(library.addBook(Book("Free-form", "Author", "abc-1", 2000, 5.0)));
+    ASSERT_FALSE(library.addBook(Book("Free-form", "Author", "abc-1", 2000, 5.0)));
+    ASSERT_EQ(library.size(), 2u);
+
+    auto found = library.searchByISBN("9780306406157");
+    ASSERT_EQ(found.size(), 1u);
+    ASSERT_EQ(found[0].isbn, "978-0-306-40615-7");  // display form is kept
+    ASSERT_EQ(library.findWhere(Query::isbn("0-306-40615-2")).size(), 1u);
+    ASSERT_TRUE(library.updateBookDetails(Book("Numerical 2e", "Author", "0 306 40615 2", 1995, 12.0)));
+    found = library.searchByISBN("0306406152");
+    ASSERT_EQ(found[0].title, "Numerical 2e");
+    ASSERT_EQ(found[0].isbn, "978-0-306-40615-7");  // still the original spelling
+    library.removeBook("978 0 306 40615 7");
+    ASSERT_TRUE(library.searchByISBN("0306406152").empty());
+    ASSERT_EQ(library.size(), 1u);
+
+    ShardedLibrary sharded(4, 1);
+    ASSERT_TRUE(sharded.addBook(Book("Numerical", "Author", "978-0-306-40615-7", 1990, 10.0)));
+    ASSERT_FALSE(sharded.addBook(Book("Numerical", "Author", "0306406152", 1990, 10.0)));
+}
+
+// Cached searches return the same results and are invalidated by every mutation
+TEST(LibraryTest, QueryCacheInvalidation) {
+    Library library;
+    library.addBook(Book("Effective C++", "Scott Meyers", "1", 2005, 40.0));
+    library.addBook(Book("Effective Java", "Joshua Bloch", "2", 2018, 45.0));
+    library.addBook(Book("C++ Primer", "Stanley Lippman", "3", 2012, 50.0));
+    library.enableQueryCache(2);
+
+    auto titles = [](const std::vector<Book> &books) {
+        std::vector<std::string> result;
+        for (const auto &book : books) result.push_back(book.title);
+        return result;
+    };
+
+    ASSERT_EQ(library.searchByTitle("Effective").size(), 2u);
+    ASSERT_EQ(library.searchByTitle("Effective").size(), 2u);
+    QueryCacheStats stats = library.queryCacheStats();
+    ASSERT_EQ(stats.hits, 1u);
+    ASSERT_EQ(stats.misses, 1u);
+    ASSERT_EQ(stats.entries, 1u);
+
+    library.addBook(Book("Effective Modern C++", "Scott Meyers", "4", 2014, 42.0));
+    ASSERT_EQ(library.searchByTitle("Effective").size(), 3u);
+    library.updateBookDetails(Book("More Effective C++", "Scott Meyers", "3", 1996, 30.0));
+    ASSERT_EQ(library.searchByTitle("Effective").size(), 4u);
+    library.removeBook("1");
+    ASSERT_EQ(library.searchByTitle("Effective").size(), 3u);
+    library.sortByPrice();
+    ASSERT_EQ(titles(library.searchByTitle("Effective")),
+              (std::vector<std::string>{"More Effective C++", "Effective Modern C++", "Effective Java"}));
+    ASSERT_EQ(library.searchByAuthor("Meyers").size(), 2u);
+    ASSERT_EQ(library.searchByAuthor("Meyers").size(), 2u);
+
+    stats = library.queryCacheStats();
+    ASSERT_EQ(stats.hits, 2u);
+    ASSERT_EQ(stats.misses, 6u);
+    ASSERT_EQ(stats.entries, 2u);
+    ASSERT_EQ(stats.capacity, 2u);
+
+    library.searchByTitle("Java");  // evicts the least recently used entry
+    ASSERT_EQ(library.queryCacheStats().evictions, 1u);
+
+    Library copy = library;
+    ASSERT_EQ(copy.queryCacheStats().entries, 0u);
+    ASSERT_EQ(copy.searchByAuthor("Meyers").size(), 2u);
+
+    library.clearBooks();
+    ASSERT_TRUE(library.searchByAuthor("Meyers").empty());
+    library.resetQueryCacheStats();
+    library.enableQueryCache(0);
+    ASSERT_TRUE(library.searchByAuthor("Meyers").empty());
+    ASSERT_EQ(library.queryCacheStats().misses, 0u);
+    ASSERT_EQ(library.queryCacheStats().entries, 0u);
+}
+
+// Maintained aggregates agree with a brute-force pass after random mutations
+TEST(LibraryTest, IncrementalAggregates) {
+    Library library;
+    library.addBook(Book("A", "Knuth", "a", 1968, 80.0));
+    library.enableAggregates(true, 25.0, 4);
+    library.addBook(Book("B", "Knuth", "b", 1973, 20.0));
+    library.addBook(Book("C", "Stroustrup", "c", 1973, 120.0));
+
+    const CatalogAggregates &stats = library.catalogAggregates();
+    ASSERT_EQ(stats.author("Knuth")->count, 2u);
+    ASSERT_DOUBLE_EQ(stats.author("Knuth")->mean(), 50.0);
+    ASSERT_EQ(stats.year(1973)->min, 20.0);
+    ASSERT_EQ(stats.year(1973)->max, 120.0);
+    ASSERT_EQ(stats.priceHistogram(), (std::vector<size_t>{1, 0, 0, 2}));
+
+    library.removeBook("c");
+    ASSERT_EQ(stats.year(1973)->max, 20.0);
+    ASSERT_FALSE(stats.author("Stroustrup").has_value());
+    library.updateBookDetails(Book("B", "Wirth", "b", 1976, 30.0));
+    ASSERT_EQ(stats.author("Knuth")->count, 1u);
+    ASSERT_FALSE(stats.year(1973).has_value());
+    ASSERT_EQ(stats.all().count, 2u);
+    ASSERT_DOUBLE_EQ(stats.all().sum, 110.0);
+
+    std::mt19937 rng(7);
+    const char *authors[] = {"Knuth", "Wirth", "Hoare", "Dijkstra"};
+    for (int step = 0; step < 3000; ++step) {
+        std::string isbn = "isbn-" + std::to_string(rng() % 500);
+        Book book("T", authors[rng() % 4], isbn, 1990 + static_cast<int>(rng() % 10), (rng() % 20000) / 100.0);
+        switch (rng() % 4) {
+        case 0: library.removeBook(isbn); break;
+        case 1: library.updateBookDetails(book); break;
+        default: library.addBook(book); break;
+        }
+    }
+    library.sortByYear();
+    ASSERT_TRUE(library.verifyAggregates(3));
+
+    std::map<std::string, PriceStats> expected;
+    for (size_t i = 0; i < library.size(); ++i) {
+        const Book &book = library.bookAt(i);
+        PriceStats &group = expected[book.author];
+        group.min = group.count == 0 ? book.price : std::min(group.min, book.price);
+        group.max = group.count == 0 ? book.price : std::max(group.max, book.price);
+        group.sum += book.price;
+        ++group.count;
+    }
+    auto actual = stats.byAuthor();
+    ASSERT_EQ(actual.size(), expected.size());
+    for (const auto &entry : actual) {
+        const PriceStats &want = expected[entry.first];
+        ASSERT_EQ(entry.second.count, want.count);
+        ASSERT_NEAR(entry.second.sum, want.sum, 1e-6);
+        ASSERT_EQ(entry.second.min, want.min);
+        ASSERT_EQ(entry.second.max, want.max);
+    }
+
+    library.clearBooks();
+    ASSERT_EQ(stats.all().count, 0u);
+    ASSERT_TRUE(stats.byYear().empty());
+}
+
+// Handles survive sorts and other removals, and go stale once their book is removed
+TEST(LibraryTest, StableBookHandles) {
+    Library library;
+    library.enableSubstringIndex();
+    library.enableOrderedIndexes();
+    library.enableAggregates();
+    for (int i = 0; i < 50; ++i) {
+        library.addBook(Book("Title " + std::to_string(i), "Author " + std::to_string(i % 5),
+                             "isbn-" + std::to_string(i), 1990 + i % 7, 100.0 - i));
+    }
+
+    BookHandle keep = library.handleOf("isbn-7");
+    BookHandle gone = library.handleOf("isbn-3");
+    ASSERT_EQ(library.handleAt(library.positionOf(keep)), keep);
+    ASSERT_TRUE(library.handleOf("missing") == BookHandle());
+    library.sortByPrice();
+    ASSERT_EQ(library.bookFor(keep)->isbn, "isbn-7");
+
+    ASSERT_TRUE(library.removeBook(gone));
+    ASSERT_FALSE(library.removeBook(gone));
+    ASSERT_EQ(library.bookFor(gone), nullptr);
+    ASSERT_EQ(library.size(), 49u);
+    ASSERT_TRUE(library.searchByISBN("isbn-3").empty());
+    ASSERT_EQ(library.searchByTitle("Title 3").size(), 10u);  // Title 30..39
+    ASSERT_EQ(library.bookFor(keep)->isbn, "isbn-7");
+
+    // Remove half the books by handle and check every index still agrees
+    std::vector<BookHandle> handles;
+    for (size_t pos = 0; pos < library.size(); ++pos) {
+        handles.push_back(library.handleAt(pos));
+    }
+    for (size_t i = 0; i < handles.size(); i += 2) {
+        if (handles[i] != keep) {
+            ASSERT_TRUE(library.removeBook(handles[i]));
+        }
+    }
+    ASSERT_EQ(library.bookFor(keep)->isbn, "isbn-7");
+    for (size_t pos = 0; pos < library.size(); ++pos) {
+        const Book &book = library.bookAt(pos);
+        ASSERT_EQ(library.positionOf(library.handleOf(book.isbn)), pos);
+        auto found = library.findByTitle(book.title);
+        ASSERT_NE(std::find(found.begin(), found.end(), pos), found.end());
+    }
+    ASSERT_TRUE(library.verifyAggregates(2));
+    size_t ordered = 0;
+    library.forEachOrdered(SortKey::Price, [&](const Book &) { return ++ordered, true; });
+    ASSERT_EQ(ordered, library.size());
+
+    // Reused slots carry a new generation; compaction keeps stale handles stale
+    library.addBook(Book("New", "Author", "isbn-new", 2020, 1.0));
+    BookHandle fresh = library.handleOf("isbn-new");
+    ASSERT_EQ(library.bookFor(fresh)->title, "New");
+    for (const auto &handle : handles) {
+        if (library.bookFor(handle) != nullptr) {
+            ASSERT_NE(library.bookFor(handle)->isbn, "isbn-new");
+        }
+    }
+    library.compact();
+    ASSERT_EQ(library.bookFor(gone), nullptr);
+    ASSERT_EQ(library.bookFor(fresh)->title, "New");
+    library.clearBooks();
+    ASSERT_EQ(library.bookFor(keep), nullptr);
+    library.addBook(Book("Again", "Author", "isbn-7", 2000, 1.0));
+    ASSERT_EQ(library.bookFor(keep), nullptr);
+}
+
+// Every sort algorithm produces the same stable order as std::stable_sort
+TEST(LibraryTest, RadixSortsAreStable) {
+    std::mt19937 rng(11);
+    Library base;
+    const double specials[] = {-0.0, 0.0, -5.5, 1e300, -1e300};
+    for (int i = 0; i < 140000; ++i) {
+        double price = i % 97 == 0 ? specials[i % 5] : (static_cast<int>(rng() % 20000) - 2000) / 100.0;
+        int year = i % 89 == 0 ? -300 + static_cast<int>(rng() % 100000) : 1900 + static_cast<int>(rng() % 120);
+        base.addBook(Book("T", "A", std::to_string(i), year, price));
+    }
+
+    auto expectedOrder = [&](bool byPrice) {
+        std::vector<size_t> order(base.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            const Book &x = base.bookAt(a), &y = base.bookAt(b);
+            return byPrice ? x.price < y.price : x.year < y.year;
+        });
+        std::vector<std::string> isbns;
+        for (size_t pos : order) isbns.push_back(base.bookAt(pos).isbn);
+        return isbns;
+    };
+    auto isbnsOf = [](const Library &library) {
+        std::vector<std::string> isbns;
+        for (size_t pos = 0; pos < library.size(); ++pos) isbns.push_back(library.bookAt(pos).isbn);
+        return isbns;
+    };
+
+    std::vector<std::string> byPrice = expectedOrder(true), byYear = expectedOrder(false);
+    for (SortAlgorithm algorithm : {SortAlgorithm::Auto, SortAlgorithm::Comparison, SortAlgorithm::Radix,
+                                    SortAlgorithm::ParallelRadix}) {
+        Library library = base;
+        library.sortByPrice(algorithm, 3);
+        ASSERT_EQ(isbnsOf(library), byPrice) << static_cast<int>(algorithm);
+        library = base;
+        library.sortByYear(algorithm, 3);
+        ASSERT_EQ(isbnsOf(library), byYear) << static_cast<int>(algorithm);
+        for (size_t pos : library.findByYearRange(1950, 1950)) {
+            ASSERT_EQ(library.bookAt(pos).year, 1950);
+        }
+        ASSERT_EQ(library.bookFor(library.handleOf("42"))->isbn, "42");
+    }
+}
+
+// Compaction triggered by a removal must not snapshot the removed book
+TEST(LibraryTest, JournalCompactionOnEveryMutation) {
+    std::string filename = "tiny_compact_books.txt";
+    std::string journalName = filename + ".journal";
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+    {
+        Library library;
+        ASSERT_TRUE(library.enableJournal(filename, 1, 1));
+        library.addBook(Book("Book A", "Author A", "111", 2001, 10.0));
+        library.addBook(Book("Book B", "Author B", "222", 2002, 20.0));
+        library.removeBook("111");
+        library.updateBookDetails(Book("Book B2", "Author B", "222", 2003, 25.0));
+        ASSERT_TRUE(library.journalHealthy());
+    }
+
+    Library library;
+    library.loadBooksFromFile(filename);
+    ASSERT_EQ(library.size(), 1u);
+    ASSERT_TRUE(library.searchByISBN("111").empty());
+    ASSERT_EQ(library.searchByISBN("222")[0].title, "Book B2");
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+
+    // A batch removal compacts at most once, after the whole batch is applied
+    {
+        Library batch;
+        ASSERT_TRUE(batch.enableJournal(filename, 1, 40));
+        std::vector<std::string> isbns;
+        for (int i = 0; i < 5; ++i) {
+            isbns.push_back("isbn-" + std::to_string(i));
+            batch.addBook(Book("Book", "Author", isbns.back(), 2000, 1.0));
+        }
+        batch.removeBooks(isbns);
+    }
+    Library reloaded;
+    reloaded.loadBooksFromFile(filename);
+    ASSERT_EQ(reloaded.size(), 0u);
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+
+    // Same for the O(1) removal by handle
+    {
+        Library handles;
+        ASSERT_TRUE(handles.enableJournal(filename, 1, 1));
+        handles.addBook(Book("Book A", "Author A", "111", 2001, 10.0));
+        handles.addBook(Book("Book B", "Author B", "222", 2002, 20.0));
+        ASSERT_TRUE(handles.removeBook(handles.handleOf("111")));
+    }
+    reloaded.clearBooks();
+    reloaded.loadBooksFromFile(filename);
+    ASSERT_EQ(reloaded.size(), 1u);
+    ASSERT_EQ(reloaded.bookAt(0).isbn, "222");
+
+    std::remove(filename.c_str());
+    std::remove(journalName.c_str());
+}
+
 // Main function to run all tests
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);